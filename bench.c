@@ -0,0 +1,653 @@
+#include "bench.h"
+
+int main(int argc, char** argv) {
+    BenchConfig config;
+    parse_args(argc, argv, &config);
+    signal(SIGPIPE, SIG_IGN);
+
+    int numTargets = config.numTargets;
+    char* nextPort = config.ports;
+    Target* targets = (Target*)calloc(numTargets, sizeof(Target));
+    for (int i = 0; i < numTargets; i++) {
+        Target* target = &targets[i];
+        target->index = i;
+        target->config = &config;
+        if (config.ports) {
+            target->port = strtol(nextPort, &nextPort, 10);
+            nextPort += *nextPort == ',';
+        } else {
+            start_depot(target, i);
+        }
+        target->fd = connect_depot(target->port);
+        if (target->fd < 0) {
+            fprintf(stderr, "bench: cannot connect to port %d\n",
+                    target->port);
+            exit(BENCH_FAILED);
+        }
+        introduce(target);
+        target->next = &targets[(i + 1) % numTargets];
+        target->source = &targets[(i + numTargets - 1) % numTargets];
+        target->expected = (long long*)calloc(config.resources,
+                sizeof(long long));
+        target->deferred = (long long*)calloc(config.resources,
+                sizeof(long long));
+        target->transferredIn = (long long*)calloc(config.resources,
+                sizeof(long long));
+        target->deferKey = 1;
+        target->sentAt = (double*)malloc(sizeof(double) *
+                (config.messages + 1));
+        target->sentTotals = (long long*)malloc(sizeof(long long) *
+                (config.messages + 1));
+        target->latencies = (double*)malloc(sizeof(double) *
+                (config.messages + 1));
+        target->random = 0x9e3779b97f4a7c15ULL * (i + 1);
+    }
+    connect_ring(targets, numTargets);
+
+    double start = now_seconds();
+    for (int i = 0; i < numTargets; i++) {
+        pthread_create(&targets[i].receiverID, NULL, receive_deliveries,
+                (void*)&targets[i]);
+        pthread_create(&targets[i].senderID, NULL, send_load,
+                (void*)&targets[i]);
+    }
+    wait_for_drain(targets, numTargets);
+    double elapsed = now_seconds() - start;
+
+    long sent = 0;
+    for (int i = 0; i < numTargets; i++) {
+        sent += targets[i].sent;
+    }
+    printf("depots %d, messages %ld in %.3fs: %.0f msg/s\n", numTargets,
+            sent, elapsed, sent / elapsed);
+    report_latency(targets, numTargets);
+
+    BenchStatus status = BENCH_OK;
+    for (int i = 0; i < numTargets; i++) {
+        if (targets[i].received != targets[i].numTransfers) {
+            status = BENCH_FAILED;
+        }
+    }
+    if (config.ports) {
+        printf("inventory: not checked for depots the benchmark did not "
+                "start\n");
+    } else {
+        bool consistent = true;
+        for (int i = 0; i < numTargets; i++) {
+            consistent = check_inventory(&targets[i]) && consistent;
+        }
+        printf("inventory: %s\n", consistent ? "consistent" : "MISMATCH");
+        if (!consistent && status == BENCH_OK) {
+            status = BENCH_INCONSISTENT;
+        }
+    }
+    for (int i = 0; i < numTargets; i++) {
+        stop_depot(&targets[i]);
+    }
+    return status;
+}
+
+/*
+ * Reads the options for a run from the command line
+ */
+void parse_args(int argc, char** argv, BenchConfig* config) {
+    config->numDepots = DEFAULT_DEPOTS;
+    config->messages = DEFAULT_MESSAGES;
+    config->rate = 0;
+    config->resources = DEFAULT_RESOURCES;
+    config->binary = "./2310depot";
+    config->ports = NULL;
+    parse_mix(DEFAULT_MIX, config);
+    int option;
+    while ((option = getopt(argc, argv, "d:n:r:k:m:b:p:h")) != -1) {
+        switch (option) {
+            case 'd':
+                config->numDepots = atoi(optarg);
+                break;
+            case 'n':
+                config->messages = atol(optarg);
+                break;
+            case 'r':
+                config->rate = atof(optarg);
+                break;
+            case 'k':
+                config->resources = atoi(optarg);
+                break;
+            case 'm':
+                parse_mix(optarg, config);
+                break;
+            case 'b':
+                config->binary = optarg;
+                break;
+            case 'p':
+                config->ports = optarg;
+                break;
+            default:
+                usage();
+        }
+    }
+    if (optind != argc || config->numDepots <= 0 ||
+            config->messages <= 0 || config->resources <= 0 ||
+            config->rate < 0) {
+        usage();
+    }
+    config->numTargets = config->numDepots;
+    if (config->ports) {
+        config->numTargets = 1;
+        for (char* comma = config->ports; (comma = strchr(comma, ','));
+                comma++) {
+            config->numTargets++;
+        }
+    }
+}
+
+/*
+ * Reads the weights of each type of message, given as colon separated
+ * numbers in the order Deliver, Withdraw, Transfer, Defer, Execute
+ */
+void parse_mix(const char* text, BenchConfig* config) {
+    config->mixTotal = 0;
+    for (int i = 0; i < SEND_TYPES; i++) {
+        char* end;
+        config->mix[i] = strtol(text, &end, 10);
+        if (end == text || config->mix[i] < 0 ||
+                (*end != (i == SEND_TYPES - 1 ? '\0' : ':'))) {
+            usage();
+        }
+        config->mixTotal += config->mix[i];
+        text = end + 1;
+    }
+    if (config->mixTotal == 0) {
+        usage();
+    }
+}
+
+/*
+ * Prints how to run the benchmark and exits
+ */
+void usage(void) {
+    fprintf(stderr, "Usage: bench [-d depots] [-n messages] [-r rate] "
+            "[-k resources]\n"
+            "             [-m deliver:withdraw:transfer:defer:execute] "
+            "[-b binary]\n"
+            "             [-p port,...]\n"
+            "Depots given with -p are connected into a ring like those "
+            "started, so\nshould not already be neighbours.\n");
+    exit(BENCH_USAGE);
+}
+
+/*
+ * Starts a depot with no goods, reading the port it listens on
+ */
+void start_depot(Target* target, int index) {
+    int fds[2];
+    if (pipe(fds) < 0) {
+        perror("bench: pipe");
+        exit(BENCH_FAILED);
+    }
+    target->pid = fork();
+    if (target->pid == 0) {
+        char name[32];
+        snprintf(name, sizeof(name), "D%d", index);
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execl(target->config->binary, target->config->binary, name,
+                (char*)NULL);
+        perror(target->config->binary);
+        _exit(BENCH_FAILED);
+    }
+    close(fds[1]);
+    target->fromDepot = fdopen(fds[0], "r");
+    char line[32];
+    if (!fgets(line, sizeof(line), target->fromDepot)) {
+        fprintf(stderr, "bench: depot %d did not start\n", index);
+        exit(BENCH_FAILED);
+    }
+    target->port = atoi(line);
+}
+
+/*
+ * Connects to a depot, retrying briefly as it may not be listening yet.
+ * Returns the socket, or -1 on failure.
+ */
+int connect_depot(int port) {
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(struct sockaddr_in));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    inet_pton(AF_INET, LOCALHOST, &address.sin_addr);
+    for (int attempt = 0; attempt < 100; attempt++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(fd, (struct sockaddr*)&address,
+                sizeof(struct sockaddr_in)) == 0) {
+            int on = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(int));
+            return fd;
+        }
+        close(fd);
+        usleep(10000);
+    }
+    return -1;
+}
+
+/*
+ * Exchanges IMs with a depot so that it treats the benchmark as a
+ * neighbour, noting the depot's name. The benchmark lists route in its
+ * Caps so that the depot tells it which depots it can reach.
+ */
+void introduce(Target* target) {
+    snprintf(target->observer, sizeof(target->observer), "%s%d",
+            BENCH_NAME, target->index);
+    char im[64];
+    int length = snprintf(im, sizeof(im), "IM:0:%s\nCaps:route\n",
+            target->observer);
+    send(target->fd, im, length, 0);
+    char line[128];
+    size_t used = 0;
+    char c;
+    while (recv(target->fd, &c, 1, 0) == 1 && c != '\n') {
+        if (used < sizeof(line) - 1) {
+            line[used++] = c;
+        }
+    }
+    line[used] = '\0';
+    char* name = strchr(line, ':');
+    name = name ? strchr(name + 1, ':') : NULL;
+    if (strncmp(line, "IM:", 3) != 0 || !name) {
+        fprintf(stderr, "bench: depot %d did not introduce itself\n",
+                target->index);
+        exit(BENCH_FAILED);
+    }
+    snprintf(target->name, sizeof(target->name), "%s", name + 1);
+}
+
+/*
+ * Connects each depot to the next one in a ring, then waits for each to
+ * learn the route to the benchmark at the next depot, which its
+ * transfers are sent to. A lone depot is left alone and transfers
+ * straight back to the benchmark.
+ */
+void connect_ring(Target* targets, int numTargets) {
+    for (int i = 0; i < numTargets; i++) {
+        Target* target = &targets[i];
+        target->numNeighbours = 1 + (numTargets > 2 ? 2 : numTargets - 1);
+        // Two depots need only one link between them
+        if (numTargets == 1 || (numTargets == 2 && i == 1)) {
+            continue;
+        }
+        char connect[32];
+        int length = snprintf(connect, sizeof(connect), "Connect:%d\n",
+                target->next->port);
+        send(target->fd, connect, length, 0);
+    }
+    for (int i = 0; i < numTargets; i++) {
+        if (targets[i].next != &targets[i]) {
+            wait_for_route(&targets[i]);
+        }
+    }
+}
+
+/*
+ * Reads the Route messages a depot sends the benchmark until one shows it
+ * can reach the benchmark at the next depot
+ */
+void wait_for_route(Target* target) {
+    struct timeval timeout = {0, 100000};
+    setsockopt(target->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+            sizeof(struct timeval));
+    char wanted[40];
+    snprintf(wanted, sizeof(wanted), ":%s:", target->next->observer);
+    char line[1024];
+    size_t used = 0;
+    double giveUp = now_seconds() + ROUTE_TIMEOUT_MS / 1000.0;
+    while (now_seconds() < giveUp) {
+        char c;
+        if (recv(target->fd, &c, 1, 0) != 1) {
+            continue;
+        }
+        if (c != '\n') {
+            if (used < sizeof(line) - 1) {
+                line[used++] = c;
+            }
+            continue;
+        }
+        line[used] = '\0';
+        used = 0;
+        if (strncmp(line, "Route:", 6) == 0 && strstr(line, wanted)) {
+            return;
+        }
+    }
+    fprintf(stderr, "bench: depot %d cannot reach depot %d\n",
+            target->index, target->next->index);
+    exit(BENCH_FAILED);
+}
+
+/*
+ * Sender thread which sends a depot its share of the load, pacing itself
+ * to the requested rate. The last message is always a transfer to the
+ * benchmark at the next depot, so its delivery shows that the depot has
+ * handled everything before it.
+ */
+void* send_load(void* param) {
+    Target* target = (Target*)param;
+    BenchConfig* config = target->config;
+    // The rate is shared evenly between the depots
+    double interval = config->rate > 0 ? config->numTargets / config->rate :
+            0;
+    char buffer[SEND_BUFFER_SIZE + 128];
+    size_t length = 0;
+    long unstamped = 0;
+    double start = now_seconds();
+    for (long i = 0; i < config->messages; i++) {
+        double due = start + i * interval;
+        if (interval > 0 && now_seconds() < due) {
+            flush_sends(target, buffer, &length, &unstamped);
+            sleep_until(due);
+        }
+        SendType type = choose_type(target);
+        if (i == config->messages - 1) {
+            type = SEND_TRANSFER;
+            target->toPeer = false;
+        }
+        long transfers = target->numTransfers;
+        length += format_message(target, type, buffer + length,
+                sizeof(buffer) - length);
+        unstamped += target->numTransfers - transfers;
+        if (length >= SEND_BUFFER_SIZE) {
+            flush_sends(target, buffer, &length, &unstamped);
+        }
+    }
+    flush_sends(target, buffer, &length, &unstamped);
+    target->sent = config->messages;
+    __atomic_store_n(&target->sendDone, true, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * Picks the type of the next message according to the mix
+ */
+SendType choose_type(Target* target) {
+    BenchConfig* config = target->config;
+    int pick = next_random(&target->random) % config->mixTotal;
+    SendType type = SEND_DELIVER;
+    while (pick >= config->mix[type]) {
+        pick -= config->mix[type++];
+    }
+    return type;
+}
+
+/*
+ * Writes a message of the given type into the buffer and records the
+ * change it will make to the depot's stock. Returns its length.
+ */
+int format_message(Target* target, SendType type, char* message,
+        size_t size) {
+    int resource = next_random(&target->random) % target->config->resources;
+    int quantity = next_random(&target->random) % 9 + 1;
+    bool withdraw;
+    switch (type) {
+        case SEND_DELIVER:
+            target->expected[resource] += quantity;
+            return snprintf(message, size, "Deliver:%d:r%d\n", quantity,
+                    resource);
+        case SEND_WITHDRAW:
+            target->expected[resource] -= quantity;
+            return snprintf(message, size, "Withdraw:%d:r%d\n", quantity,
+                    resource);
+        case SEND_TRANSFER:
+            target->expected[resource] -= quantity;
+            if (target->toPeer && target->next != target) {
+                // Every other transfer goes to the next depot's own stock
+                target->toPeer = false;
+                __atomic_fetch_add(&target->next->transferredIn[resource],
+                        quantity, __ATOMIC_RELAXED);
+                return snprintf(message, size, "Transfer:%d:r%d:%s\n",
+                        quantity, resource, target->next->name);
+            }
+            target->toPeer = true;
+            target->sentTotals[target->numTransfers] = quantity +
+                    (target->numTransfers ?
+                    target->sentTotals[target->numTransfers - 1] : 0);
+            target->numTransfers++;
+            return snprintf(message, size, "Transfer:%d:r%d:%s\n",
+                    quantity, resource, target->next->observer);
+        case SEND_DEFER:
+            withdraw = next_random(&target->random) & 1;
+            target->deferred[resource] += withdraw ? -quantity : quantity;
+            return snprintf(message, size, "Defer:%u:%s:%d:r%d\n",
+                    target->deferKey, withdraw ? "Withdraw" : "Deliver",
+                    quantity, resource);
+        default:
+            for (int i = 0; i < target->config->resources; i++) {
+                target->expected[i] += target->deferred[i];
+                target->deferred[i] = 0;
+            }
+            return snprintf(message, size, "Execute:%u\n",
+                    target->deferKey++);
+    }
+}
+
+/*
+ * Sends everything buffered, first noting the send time of each transfer
+ * in it
+ */
+void flush_sends(Target* target, char* buffer, size_t* length,
+        long* unstamped) {
+    if (*length == 0) {
+        return;
+    }
+    double now = now_seconds();
+    for (long i = 0; i < *unstamped; i++) {
+        target->sentAt[target->stamped + i] = now;
+    }
+    __atomic_store_n(&target->stamped, target->stamped + *unstamped,
+            __ATOMIC_RELEASE);
+    *unstamped = 0;
+    size_t done = 0;
+    while (done < *length) {
+        ssize_t sent = send(target->fd, buffer + done, *length - done, 0);
+        if (sent < 0 && errno != EINTR) {
+            perror("bench: send");
+            exit(BENCH_FAILED);
+        }
+        done += sent > 0 ? sent : 0;
+    }
+    *length = 0;
+}
+
+/*
+ * Receiver thread which matches each delivery arriving at a depot to the
+ * previous depot's transfers whose quantities it covers, recording the
+ * time between them. Gives up if deliveries stop arriving for
+ * DRAIN_TIMEOUT_MS.
+ */
+void* receive_deliveries(void* param) {
+    Target* target = (Target*)param;
+    Target* source = target->source;
+    struct timeval timeout = {0, 100000};
+    setsockopt(target->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+            sizeof(struct timeval));
+    FILE* fromDepot = fdopen(dup(target->fd), "r");
+    char* line = NULL;
+    size_t size = 0;
+    double lastHeard = now_seconds();
+    while (!__atomic_load_n(&source->sendDone, __ATOMIC_ACQUIRE) ||
+            source->received < source->numTransfers) {
+        if (getline(&line, &size, fromDepot) < 0) {
+            clearerr(fromDepot);
+            if (now_seconds() - lastHeard > DRAIN_TIMEOUT_MS / 1000.0) {
+                fprintf(stderr, "bench: depot %d delivered %ld of %ld "
+                        "transfers from depot %d\n", target->index,
+                        source->received, source->numTransfers,
+                        source->index);
+                break;
+            }
+            continue;
+        }
+        lastHeard = now_seconds();
+        if (strncmp(line, "Deliver:", 8) != 0) {
+            continue;
+        }
+        source->returned += strtol(line + 8, NULL, 10);
+        long long settled = source->received ?
+                source->sentTotals[source->received - 1] : 0;
+        while (settled < source->returned) {
+            // The send time is noted just before the transfer goes out
+            while (__atomic_load_n(&source->stamped, __ATOMIC_ACQUIRE) <=
+                    source->received) {
+                sched_yield();
+            }
+            settled = source->sentTotals[source->received];
+            if (settled > source->returned) {
+                break;
+            }
+            source->latencies[source->numLatencies++] = lastHeard -
+                    source->sentAt[source->received++];
+        }
+    }
+    free(line);
+    fclose(fromDepot);
+    return 0;
+}
+
+/*
+ * Waits for every depot to be sent its load and to return every transfer
+ */
+void wait_for_drain(Target* targets, int numTargets) {
+    for (int i = 0; i < numTargets; i++) {
+        pthread_join(targets[i].senderID, NULL);
+    }
+    for (int i = 0; i < numTargets; i++) {
+        pthread_join(targets[i].receiverID, NULL);
+    }
+}
+
+/*
+ * Prints percentiles of the time from sending a transfer to receiving its
+ * delivery at the next depot, across all depots
+ */
+void report_latency(Target* targets, int numTargets) {
+    long count = 0;
+    for (int i = 0; i < numTargets; i++) {
+        count += targets[i].numLatencies;
+    }
+    if (count == 0) {
+        printf("transfer latency: no transfers returned\n");
+        return;
+    }
+    double* all = (double*)malloc(sizeof(double) * count);
+    long next = 0;
+    for (int i = 0; i < numTargets; i++) {
+        memcpy(all + next, targets[i].latencies,
+                sizeof(double) * targets[i].numLatencies);
+        next += targets[i].numLatencies;
+    }
+    qsort(all, count, sizeof(double), comp_doubles);
+    printf("transfer latency us: p50 %.0f p99 %.0f p999 %.0f max %.0f "
+            "(n=%ld)\n", all[(long)(0.5 * (count - 1))] * 1e6,
+            all[(long)(0.99 * (count - 1))] * 1e6,
+            all[(long)(0.999 * (count - 1))] * 1e6,
+            all[count - 1] * 1e6, count);
+    free(all);
+}
+
+/*
+ * Asks a depot for its goods with SIGHUP and compares them with what the
+ * messages sent to it and the transfers to it from the previous depot
+ * should have left. Returns whether they match.
+ */
+bool check_inventory(Target* target) {
+    int resources = target->config->resources;
+    long long* actual = (long long*)calloc(resources, sizeof(long long));
+    bool consistent = true;
+    kill(target->pid, SIGHUP);
+    char line[256];
+    bool inGoods = false;
+    while (fgets(line, sizeof(line), target->fromDepot)) {
+        if (strcmp(line, "Goods:\n") == 0) {
+            inGoods = true;
+        } else if (strcmp(line, "Neighbours:\n") == 0) {
+            // The benchmark and the depots either side in the ring
+            for (int i = 0; i < target->numNeighbours; i++) {
+                fgets(line, sizeof(line), target->fromDepot);
+            }
+            break;
+        } else if (inGoods) {
+            int resource;
+            long long quantity;
+            if (sscanf(line, "r%d %lld", &resource, &quantity) == 2 &&
+                    resource >= 0 && resource < resources) {
+                actual[resource] = quantity;
+            } else {
+                fprintf(stderr, "bench: depot %d has unexpected %s",
+                        target->index, line);
+                consistent = false;
+            }
+        }
+    }
+    for (int i = 0; i < resources; i++) {
+        long long expected = target->expected[i] + target->transferredIn[i];
+        if (actual[i] != expected) {
+            fprintf(stderr, "bench: depot %d has r%d %lld, expected %lld\n",
+                    target->index, i, actual[i], expected);
+            consistent = false;
+        }
+    }
+    free(actual);
+    return consistent;
+}
+
+/*
+ * Closes the connection to a depot, stopping it if the benchmark started
+ * it
+ */
+void stop_depot(Target* target) {
+    close(target->fd);
+    if (target->pid > 0) {
+        kill(target->pid, SIGTERM);
+        waitpid(target->pid, NULL, 0);
+        fclose(target->fromDepot);
+    }
+}
+
+/*
+ * Current time in seconds from a monotonic clock
+ */
+double now_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+ * Sleeps until the monotonic clock reaches the given time
+ */
+void sleep_until(double when) {
+    struct timespec until;
+    until.tv_sec = (time_t)when;
+    until.tv_nsec = (long)((when - until.tv_sec) * 1e9);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until,
+            NULL) == EINTR) {
+    }
+}
+
+/*
+ * Advances a xorshift generator, returning its next value
+ */
+uint64_t next_random(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+/*
+ * Custom comparator for sorting times
+ */
+int comp_doubles(const void* v1, const void* v2) {
+    double x1 = *((double*)v1);
+    double x2 = *((double*)v2);
+    return (x1 > x2) - (x1 < x2);
+}
@@ -0,0 +1,166 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define LOCALHOST "127.0.0.1"
+
+/* Name the benchmark gives itself when acting as a neighbour, followed by
+ * the index of the depot it is attached to */
+#define BENCH_NAME "bench"
+/* Default number of depots started */
+#define DEFAULT_DEPOTS 2
+/* Default number of messages sent to each depot */
+#define DEFAULT_MESSAGES 100000
+/* Default number of distinct resources used at each depot */
+#define DEFAULT_RESOURCES 64
+/* Default weights of Deliver, Withdraw, Transfer, Defer and Execute */
+#define DEFAULT_MIX "30:20:40:8:2"
+/* Messages are gathered into writes of about this many bytes */
+#define SEND_BUFFER_SIZE 16384
+/* Longest time to wait for every Transfer to come back */
+#define DRAIN_TIMEOUT_MS 30000
+/* Longest time to wait for the depots to learn their routes to each other */
+#define ROUTE_TIMEOUT_MS 10000
+
+typedef struct BenchConfig BenchConfig;
+typedef struct Target Target;
+
+/*
+ * Exit statuses for the benchmark
+ */
+typedef enum {
+    BENCH_OK = 0,
+    BENCH_USAGE = 1,
+    BENCH_FAILED = 2,
+    BENCH_INCONSISTENT = 3
+} BenchStatus;
+
+/*
+ * Types of message the benchmark sends, in the order of the mix weights
+ */
+typedef enum {
+    SEND_DELIVER,
+    SEND_WITHDRAW,
+    SEND_TRANSFER,
+    SEND_DEFER,
+    SEND_EXECUTE,
+    SEND_TYPES
+} SendType;
+
+/*
+ * Options for a run, taken from the command line
+ */
+struct BenchConfig {
+    int numDepots;
+    long messages;
+    double rate;
+    int resources;
+    int mix[SEND_TYPES];
+    int mixTotal;
+    char* binary;
+    char* ports;
+    int numTargets;
+};
+
+/*
+ * A depot being driven by the benchmark, with the connection the
+ * benchmark holds to it as a neighbour. The depots are connected in a
+ * ring, and each sends its transfers to the next one round it. One thread
+ * sends the load and another reads back the deliveries that the previous
+ * depot's transfers cause here.
+ */
+struct Target {
+    int index;
+    BenchConfig* config;
+    pid_t pid;
+    FILE* fromDepot;
+    int port;
+    int fd;
+    pthread_t senderID;
+    pthread_t receiverID;
+
+    // The depot's own name, the name the benchmark goes by as its
+    // neighbour, and how many neighbours it has once the ring is joined
+    char name[64];
+    char observer[32];
+    int numNeighbours;
+    // The depot this one transfers to, and the one whose transfers are
+    // delivered back through it
+    Target* next;
+    Target* source;
+
+    // Expected stock of each resource once everything has been handled,
+    // and the change still held back under the open Defer key.
+    // transferredIn is what other depots have transferred to this one.
+    long long* expected;
+    long long* deferred;
+    long long* transferredIn;
+    unsigned deferKey;
+    // Whether the next transfer goes to the next depot itself rather than
+    // to the benchmark's neighbour there
+    bool toPeer;
+
+    // Send time of each transfer to the benchmark at the next depot, in
+    // the order they were sent, and the total quantity of it and every
+    // such transfer before it. stamped counts
+    // the times written so far and received those matched. returned is
+    // the total quantity delivered back, which a depot coalescing its
+    // deliveries may return several transfers at a time.
+    double* sentAt;
+    long long* sentTotals;
+    long long returned;
+    long numTransfers;
+    long stamped;
+    long received;
+    bool sendDone;
+    double* latencies;
+    long numLatencies;
+
+    long sent;
+    uint64_t random;
+};
+
+/* Functions for setting up a run */
+void parse_args(int argc, char** argv, BenchConfig* config);
+void parse_mix(const char* text, BenchConfig* config);
+void usage(void);
+void start_depot(Target* target, int index);
+int connect_depot(int port);
+void introduce(Target* target);
+void connect_ring(Target* targets, int numTargets);
+void wait_for_route(Target* target);
+
+/* Functions for driving the load */
+void* send_load(void* param);
+SendType choose_type(Target* target);
+int format_message(Target* target, SendType type, char* message,
+        size_t size);
+void flush_sends(Target* target, char* buffer, size_t* length,
+        long* unstamped);
+void* receive_deliveries(void* param);
+
+/* Functions for reporting the results */
+void wait_for_drain(Target* targets, int numTargets);
+void report_latency(Target* targets, int numTargets);
+bool check_inventory(Target* target);
+void stop_depot(Target* target);
+
+/* Helper functions */
+double now_seconds(void);
+void sleep_until(double when);
+uint64_t next_random(uint64_t* state);
+int comp_doubles(const void* v1, const void* v2);
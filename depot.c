@@ -4,6 +4,80 @@
 Depot* depotCpy;
 // Mutex lock to ensure mutual exclusion
 pthread_mutex_t depotLock = PTHREAD_MUTEX_INITIALIZER;
+// Mutex lock held while adding a chunk to the resource table
+pthread_mutex_t resourceLock = PTHREAD_MUTEX_INITIALIZER;
+// Every resource and depot name seen by this process
+NameTable names;
+// Mutex lock held while adding a name to the name table
+pthread_mutex_t nameLock = PTHREAD_MUTEX_INITIALIZER;
+// Held for reading while a change is applied and logged, and for writing
+// while a snapshot is taken. Writers are preferred so that a steady flow
+// of changes cannot hold off a snapshot.
+pthread_rwlock_t persistLock = 
+        PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+// Metrics of every thread which has handled a message, pushed without a
+// lock, and the calling thread's own entry
+ThreadMetrics* metricsList;
+__thread ThreadMetrics* threadMetrics;
+// Name of each type of message as it appears in the stats dump
+const char* const messageTypeNames[] = {
+    [CONNECT] = "Connect",
+    [IM] = "IM",
+    [DELIVER] = "Deliver",
+    [WITHDRAW] = "Withdraw",
+    [TRANSFER] = "Transfer",
+    [DEFER] = "Defer",
+    [EXECUTE] = "Execute",
+    [BATCH] = "Batch",
+    [CAPS] = "Caps",
+    [BINARY] = "Binary",
+    [ROUTE] = "Route",
+    [FORWARD] = "Forward",
+    [CREDIT] = "Credit",
+    [INVALID] = "Invalid"
+};
+// Name of each capability in a 'Caps' message, by bit
+const char* const capabilityNames[] = {"batch", "binary", "route",
+        "credit"};
+// Readers of the neighbour table, pushed without a lock, the calling
+// thread's own entry and the epoch advanced each time a table is replaced
+RcuReader* rcuReaders;
+__thread RcuReader* threadReader;
+uint64_t rcuEpoch = 1;
+// The calling thread's merged delivery for each name ID while it merges a
+// run of deliveries
+__thread OutMessage** coalesceSlots;
+__thread int coalesceSlotsSize;
+// The calling thread's net change to each name ID's resource while it
+// applies a key's deferred tasks, and whether the name has been seen yet
+__thread long long* deferredDeltas;
+__thread bool* deferredTouched;
+__thread int deferredDeltasSize;
+// The calling thread's batch of tasks being gathered for each shard
+__thread ShardBatch** shardBatches;
+// Neighbour whose messages the calling thread is handling, if any
+__thread Neighbour* dispatching;
+// End of the last record the calling thread logged, which anything it
+// sends afterwards waits to have synced
+__thread uint64_t loggedLsn;
+// Handler for each type of message. Only Defer and Route hold depotLock
+// throughout; Execute takes it just long enough to claim its key's tasks.
+const CommandHandler commandHandlers[] = {
+    [CONNECT] = {handle_connect_message, false},
+    [IM] = {NULL, false},
+    [DELIVER] = {add_resource, false},
+    [WITHDRAW] = {withdraw_resource, false},
+    [TRANSFER] = {handle_transfer_message, false},
+    [DEFER] = {handle_defer_message, true},
+    [EXECUTE] = {handle_execute, false},
+    [BATCH] = {handle_batch_message, false},
+    [CAPS] = {handle_caps_message, false},
+    [BINARY] = {handle_binary_message, false},
+    [ROUTE] = {handle_route_message, true},
+    [FORWARD] = {handle_forward_message, false},
+    [CREDIT] = {handle_credit_message, false},
+    [INVALID] = {NULL, false}
+};
 
 int main(int argc, char** argv) {
     Depot depot;
@@ -28,11 +102,13 @@ void init_depot(int argc, char** argv, Depot* depot) {
         depot->depotName = argv[1];
     }
 
-    depot->numResources = (argc - 2) / 2;
-    depot->resources = (Resource*)malloc(sizeof(Resource) * 
-            depot->numResources);
-
-    for (int i = 0; i < depot->numResources; i++) {
+    init_names();
+    depot->nameId = intern_name((Field){depot->depotName, 
+            strlen(depot->depotName)});
+    init_resources(depot);
+    int numGoods = (argc - 2) / 2;
+    Task* goods = (Task*)malloc(sizeof(Task) * (numGoods + 1));
+    for (int i = 0; i < numGoods; i++) {
         char* err;
         char* name;
         if (strcmp(argv[2 * i + 2], "") == 0 || contains_bad_char
@@ -48,11 +124,218 @@ void init_depot(int argc, char** argv, Depot* depot) {
         if (*err != '\0' || quantity < 0) {
             exit_depot(BAD_QUANTITY);
         }
-        depot->resources[i] = (Resource){.quantity = quantity, 
-                .resourceName = name};
+        Field field = {name, strlen(name)};
+        goods[i] = (Task){.type = DELIVER, .quantity = quantity, 
+                .nameId = intern_name(field), .destId = -1};
+    }
+    depot->neighbourTable = build_neighbour_table(NULL, 0);
+    depot->retiredTables = NULL;
+    init_deferred(depot);
+    depot->numEventLoops = 0;
+    depot->nextEventLoop = 0;
+    depot->connectionsClosed = 0;
+    depot->backlogged = 0;
+    pthread_mutex_init(&depot->backlogLock, NULL);
+    pthread_cond_init(&depot->backlogDrained, NULL);
+    init_config(&depot->config);
+    init_shards(depot);
+    depot->capsMessage = format_capabilities(CAP_BATCH | CAP_ROUTE | 
+            CAP_CREDIT | (depot->config.binary ? CAP_BINARY : 0), 
+            depot->config.creditWindow);
+    // A depot restored from its data directory already holds its goods
+    if (!recover_state(depot)) {
+        for (int i = 0; i < numGoods; i++) {
+            if (!shard_task(depot, &goods[i])) {
+                begin_change(depot);
+                apply_task(depot, &goods[i]);
+                log_task(depot, &goods[i]);
+                end_change(depot);
+            }
+        }
+        if (depot->config.goodsFile) {
+            load_goods_file(depot);
+        }
+        drain_shards(depot);
+    }
+    free(goods);
+}
+
+/*
+ * Adds the goods listed in DEPOT_GOODS_FILE, one name and quantity per
+ * line separated by spaces or tabs. The file is mapped into memory and
+ * split at line boundaries into chunks parsed by separate threads. Every
+ * line is checked before any of it is added, so a bad file leaves the
+ * depot untouched.
+ */
+void load_goods_file(Depot* depot) {
+    int fd = open(depot->config.goodsFile, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) < 0) {
+        exit_depot(BAD_GOODS_FILE);
+    }
+    size_t size = info.st_size;
+    if (size == 0) {
+        close(fd);
+        return;
+    }
+    const char* data = (const char*)mmap(NULL, size, PROT_READ, 
+            MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        exit_depot(BAD_GOODS_FILE);
+    }
+    madvise((void*)data, size, MADV_SEQUENTIAL);
+    int numLines = 0;
+    for (const char* line = data; (line = memchr(line, '\n', 
+            data + size - line)); line++) {
+        numLines++;
+    }
+    reserve_names(numLines + 1);
+
+    int numChunks = sysconf(_SC_NPROCESSORS_ONLN);
+    if (numChunks > (int)(size / GOODS_CHUNK_MIN) + 1) {
+        numChunks = size / GOODS_CHUNK_MIN + 1;
+    }
+    if (numChunks > GOODS_FILE_THREADS) {
+        numChunks = GOODS_FILE_THREADS;
+    } else if (numChunks < 1) {
+        numChunks = 1;
+    }
+    GoodsChunk* chunks = (GoodsChunk*)calloc(numChunks, sizeof(GoodsChunk));
+    const char* end = data + size;
+    const char* start = data;
+    for (int i = 0; i < numChunks; i++) {
+        const char* split = i == numChunks - 1 ? end : 
+                data + size / numChunks * (i + 1);
+        if (split < start) {
+            split = start;
+        }
+        const char* newline = memchr(split, '\n', end - split);
+        chunks[i].start = start;
+        chunks[i].end = start = newline ? newline + 1 : end;
+        pthread_create(&chunks[i].threadID, NULL, parse_goods_chunk, 
+                (void*)&chunks[i]);
+    }
+    DepotStatus status = 0;
+    for (int i = 0; i < numChunks; i++) {
+        pthread_join(chunks[i].threadID, NULL);
+        if (!status) {
+            status = chunks[i].status;
+        }
+    }
+    munmap((void*)data, size);
+    if (status) {
+        exit_depot(status);
+    }
+    for (int i = 0; i < numChunks; i++) {
+        if (depot->numShards > 0) {
+            for (int j = 0; j < chunks[i].numTasks; j++) {
+                shard_task(depot, &chunks[i].tasks[j]);
+            }
+        } else if (chunks[i].numTasks > 0) {
+            begin_change(depot);
+            for (int j = 0; j < chunks[i].numTasks; j++) {
+                apply_task(depot, &chunks[i].tasks[j]);
+            }
+            log_batch(depot, chunks[i].tasks, chunks[i].numTasks);
+            end_change(depot);
+        }
+        free(chunks[i].tasks);
+    }
+    free(chunks);
+}
+
+/*
+ * Thread which parses one chunk of a goods file into deliveries, checking
+ * names and quantities in the same way as the command line. Blank lines
+ * are skipped. Stops at the first bad line.
+ */
+void* parse_goods_chunk(void* param) {
+    GoodsChunk* chunk = (GoodsChunk*)param;
+    const char* next = chunk->start;
+    while (next < chunk->end) {
+        const char* lineEnd = memchr(next, '\n', chunk->end - next);
+        if (!lineEnd) {
+            lineEnd = chunk->end;
+        }
+        Field fields[3];
+        int numFields = 0;
+        while (next < lineEnd) {
+            if (*next == ' ' || *next == '\t' || *next == '\r') {
+                next++;
+                continue;
+            }
+            if (numFields == 3) {
+                break;
+            }
+            Field* field = &fields[numFields++];
+            field->start = next;
+            while (next < lineEnd && *next != ' ' && *next != '\t' && 
+                    *next != '\r') {
+                next++;
+            }
+            field->length = next - field->start;
+        }
+        next = lineEnd + 1;
+        if (numFields == 0) {
+            continue;
+        }
+        unsigned long quantity;
+        if (numFields != 2) {
+            chunk->status = BAD_GOODS_FILE;
+        } else if (memchr(fields[0].start, ':', fields[0].length)) {
+            chunk->status = BAD_NAME;
+        } else if (!parse_number(fields[1], &quantity) || 
+                (int)quantity < 0) {
+            chunk->status = BAD_QUANTITY;
+        }
+        if (chunk->status) {
+            return NULL;
+        }
+        if (chunk->numTasks == chunk->capacity) {
+            chunk->capacity = chunk->capacity ? chunk->capacity * 2 : 1024;
+            chunk->tasks = (Task*)realloc(chunk->tasks, sizeof(Task) * 
+                    chunk->capacity);
+        }
+        chunk->tasks[chunk->numTasks++] = (Task){.type = DELIVER, 
+                .quantity = quantity, .nameId = intern_name(fields[0]), 
+                .destId = -1};
+    }
+    return NULL;
+}
+
+/*
+ * Read the optional runtime settings from the environment
+ */
+void init_config(DepotConfig* config) {
+    config->eventWorkers = env_int("DEPOT_EVENT_WORKERS", 0);
+    config->handshakeTimeout = env_int("DEPOT_HANDSHAKE_TIMEOUT_MS", 
+            HANDSHAKE_TIMEOUT_MS);
+    config->dataDir = getenv("DEPOT_DATA_DIR");
+    if (config->dataDir && strlen(config->dataDir) == 0) {
+        config->dataDir = NULL;
+    }
+    config->snapshotInterval = env_int("DEPOT_SNAPSHOT_MS", 
+            SNAPSHOT_INTERVAL_MS);
+    config->binary = env_int("DEPOT_BINARY", 1) != 0;
+    config->coalesceWindow = env_int("DEPOT_COALESCE_US", 0);
+    config->creditWindow = env_int("DEPOT_CREDIT_BYTES", CREDIT_WINDOW);
+    config->shards = env_int("DEPOT_SHARDS", 0);
+    config->goodsFile = getenv("DEPOT_GOODS_FILE");
+    if (config->goodsFile && strlen(config->goodsFile) == 0) {
+        config->goodsFile = NULL;
+    }
+    config->uring = env_int("DEPOT_URING", 0) != 0;
+#ifndef DEPOT_URING
+    if (config->uring) {
+        fputs("depot: built without io_uring, using epoll\n", stderr);
+        config->uring = false;
+    }
+#endif
+    if (config->uring && config->eventWorkers <= 0) {
+        // Neighbours are only served through io_uring by the event loops
+        config->eventWorkers = 1;
     }
-    depot->numNeighbours = 0;
-    depot->numDeferredTasks = 0;
 }
 
 /*
@@ -62,31 +345,55 @@ void exit_depot(DepotStatus status) {
     const char* messages[] = {"",
             "Usage: 2310depot name {goods qty}\n",
             "Invalid name(s)\n",
-            "Invalid quantity\n"};
+            "Invalid quantity\n",
+            "Invalid goods file\n"};
     fputs(messages[status], stderr);
     exit(status);
 }
 
 /*
- * Print the current resources and neighbours to stdout
+ * Print the current resources and neighbours to stdout. The neighbour
+ * names are copied from the published table and each quantity is read
+ * once, so sorting and printing never hold up message handling.
  */
 void print_info(Depot* depot) {
-    fprintf(stdout, "Goods:\n");
-    qsort(depot->resources, depot->numResources, sizeof(Resource), 
-            comp_resources);
-    for (int i = 0; i < depot->numResources; i++) {
-        if (depot->resources[i].quantity != 0) {
-            fprintf(stdout, "%s %d\n", depot->resources[i].resourceName, 
-                    depot->resources[i].quantity);
+    rcu_read_lock();
+    NeighbourTable* table = read_neighbours(depot);
+    int numNeighbours = table->numNeighbours;
+    int* neighbourNames = (int*)malloc(sizeof(int) * (numNeighbours + 1));
+    for (int i = 0; i < numNeighbours; i++) {
+        neighbourNames[i] = table->neighbours[i]->nameId;
+    }
+    rcu_read_unlock();
+
+    int numNames = __atomic_load_n(&names.numNames, __ATOMIC_ACQUIRE);
+    Resource* resources = (Resource*)malloc(sizeof(Resource) * 
+            (numNames + 1));
+    int numResources = 0;
+    for (int i = 0; i < numNames; i++) {
+        Resource* resource = find_resource(depot, i);
+        long long quantity = resource ? 
+                __atomic_load_n(&resource->quantity, __ATOMIC_RELAXED) : 0;
+        if (quantity != 0) {
+            resources[numResources++] = (Resource){.quantity = quantity, 
+                    .nameId = i};
         }
     }
+
+    qsort(resources, numResources, sizeof(Resource), comp_resources);
+    qsort(neighbourNames, numNeighbours, sizeof(int), comp_names);
+    fprintf(stdout, "Goods:\n");
+    for (int i = 0; i < numResources; i++) {
+        fprintf(stdout, "%s %lld\n", name_text(resources[i].nameId), 
+                resources[i].quantity);
+    }
     fprintf(stdout, "Neighbours:\n");
-    qsort(depot->neighbours, depot->numNeighbours, sizeof(Neighbour), 
-            comp_neighbours);
-    for (int i = 0; i < depot->numNeighbours; i++) {
-        fprintf(stdout, "%s\n", depot->neighbours[i].neighbourName);
+    for (int i = 0; i < numNeighbours; i++) {
+        fprintf(stdout, "%s\n", name_text(neighbourNames[i]));
     }
     fflush(stdout);
+    free(resources);
+    free(neighbourNames);
 }
 
 /*
@@ -106,532 +413,5188 @@ void start_server(Depot* depot) {
     memset(&ad, 0, sizeof(struct sockaddr_in));
     socklen_t len = sizeof(struct sockaddr_in);
     getsockname(serv, (struct sockaddr*)&ad, &len);
+    // Listen before announcing the port so nobody is refused in between
+    listen(serv, SOMAXCONN);
     printf("%u\n", ntohs(ad.sin_port));
     fflush(stdout);
     int portLength = snprintf(NULL, 0, "%d", ntohs(ad.sin_port));
     depot->port = (char*)malloc(portLength + 1);
     snprintf(depot->port, portLength + 1, "%d", ntohs(ad.sin_port));
-    listen(serv, SOMAXCONN);
-    int connFd;
-    while (connFd = accept(serv, 0, 0), connFd >= 0) {
-        pthread_mutex_lock(&depotLock);
-        Neighbour* neighbour = (Neighbour*)malloc(sizeof(Neighbour));
-        neighbour->depot = depot;
-        int connFdIn = dup(connFd);
-        neighbour->toNeighbour = fdopen(connFd, "w");
-        neighbour->fromNeighbour = fdopen(connFdIn, "r");
-        char* imMessage = read_line(neighbour->fromNeighbour, 10);
-        if (determine_message_type(imMessage) == IM) {
-            add_neighbour(depot, neighbour, imMessage);
-        } else {
-            fclose(neighbour->toNeighbour);
-            fclose(neighbour->fromNeighbour);
+    start_persistence(depot);
+    init_event_loops(depot);
+    init_connector(depot);
+#ifdef DEPOT_URING
+    if (depot->config.uring) {
+        uring_accept(depot, serv);
+    }
+#endif
+    // Accepting never waits on a peer: each connection's IM is awaited by
+    // the connector, which registers it once the IM arrives
+    while (1) {
+        int connFd = accept4(serv, 0, 0, SOCK_NONBLOCK);
+        if (connFd >= 0) {
+            accept_handshake(depot, connFd);
+        } else if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || 
+                errno == ENOMEM) {
+            // Out of descriptors or memory, so give handshakes under way
+            // a chance to finish or time out
+            poll(NULL, 0, 10);
+        } else if (errno != EINTR && errno != ECONNABORTED) {
+            return;
         }
-        fprintf(neighbour->toNeighbour, "IM:%s:%s\n", depot->port, 
-                depot->depotName);
-        fflush(neighbour->toNeighbour);
+    }
+}
+
+/*
+ * Wraps a connected socket in a new neighbour with a queue for writing and
+ * a line reader for reading. An existing reader for the socket may be
+ * handed over so that nothing it has buffered is lost. The neighbour's
+ * writer can be woken straight away, so messages may be queued for it
+ * before it is started. Must be called while holding depotLock.
+ */
+Neighbour* open_neighbour(Depot* depot, int connFd, LineReader* reader) {
+    Neighbour* neighbour = (Neighbour*)malloc(sizeof(Neighbour));
+    neighbour->depot = depot;
+    neighbour->loop = NULL;
+    neighbour->nextDirty = NULL;
+    neighbour->nextDeparted = NULL;
+    neighbour->feeding = false;
+    neighbour->held = false;
+    neighbour->receiving = false;
+    neighbour->caps = 0;
+    neighbour->capsSent = false;
+    neighbour->advertised = NULL;
+    neighbour->numAdvertised = 0;
+    neighbour->routesSent = NULL;
+    neighbour->granting = false;
+    neighbour->creditGranted = 0;
+    neighbour->creditHandled = 0;
+    neighbour->messageStart = 0;
+    init_out_queue(&neighbour->out, depot->config.coalesceWindow > 0);
+    if (depot->numEventLoops == 0) {
+        neighbour->out.wakeFd = eventfd(0, 0);
+    } else {
+        neighbour->loop = &depot->eventLoops[depot->nextEventLoop++ % 
+                depot->numEventLoops];
+    }
+    if (reader) {
+        neighbour->reader = *reader;
+    } else {
+        init_line_reader(&neighbour->reader, connFd);
+    }
+    return neighbour;
+}
 
+/*
+ * Starts servicing messages to and from a neighbour, either on its own
+ * reader and writer threads or on one of the event loops. Must be called
+ * while holding depotLock.
+ */
+void start_neighbour(Neighbour* neighbour) {
+    EventLoop* loop = neighbour->loop;
+    if (!loop) {
         pthread_create(&neighbour->threadID, NULL, conn_handler, 
-                (void*) neighbour);
-        pthread_mutex_unlock(&depotLock);
+                (void*)neighbour);
+        pthread_create(&neighbour->writerID, NULL, writer_thread, 
+                (void*)neighbour);
+        return;
     }
+    neighbour->threadID = loop->threadID;
+    neighbour->writerID = loop->threadID;
+    // The loop registers the neighbour itself, as lines may already be
+    // waiting in its reader from the handshake
+    pthread_mutex_lock(&loop->lock);
+    if (loop->numAdopted == loop->adoptedCapacity) {
+        loop->adoptedCapacity = loop->adoptedCapacity * 2 + 1;
+        loop->adopted = (Neighbour**)realloc(loop->adopted, 
+                sizeof(Neighbour*) * loop->adoptedCapacity);
+    }
+    loop->adopted[loop->numAdopted++] = neighbour;
+    pthread_mutex_unlock(&loop->lock);
+    uint64_t wake = 1;
+    write(loop->wakeFd, &wake, sizeof(uint64_t));
 }
 
 /*
- * Connection handler for each connection to the depot. Reads and writes
- * messages between depots.
+ * Connection handler for each connection to the depot. Reads and handles
+ * messages from a neighbour until its connection closes, then tears it
+ * down.
  */
 void* conn_handler(void* param) {
-    pthread_mutex_lock(&depotLock);
     Neighbour* neighbour = (Neighbour*)param;
-    pthread_mutex_unlock(&depotLock);
-    while(1) {
-        char* msg = read_line(neighbour->fromNeighbour, 10);
-        pthread_mutex_lock(&depotLock);
-        if (determine_message_type(msg) == DELIVER) {
-            add_resource(neighbour->depot, msg);
-        }
-        if (determine_message_type(msg) == WITHDRAW) {
-            withdraw_resource(neighbour->depot, msg);
-        }
-        if (determine_message_type(msg) == DEFER) {
-            handle_defer_message(neighbour->depot, msg);
-        }
-        if (determine_message_type(msg) == EXECUTE) {
-            handle_execute(neighbour->depot, msg);
-        }
-        if (determine_message_type(msg) == CONNECT) {
-            handle_connect_message(neighbour->depot, msg);
-        }
-        if (determine_message_type(msg) == TRANSFER) {
-            handle_transfer_message(neighbour->depot, msg);
+    while (1) {
+        dispatch_lines(neighbour);
+        wait_for_backlog(neighbour);
+        if (neighbour->reader.eof || 
+                fill_line_reader(&neighbour->reader, 0) < 0) {
+            break;
         }
-        pthread_mutex_unlock(&depotLock);
     }
+    close_neighbour(neighbour);
+    release_rcu_reader();
+    release_thread_metrics();
+    release_shard_batches();
+    pthread_detach(pthread_self());
     pthread_exit(NULL);
 }
 
 /*
- * Adds the depot as described by the 'IM' message as a neighbour
+ * Tears down a neighbour whose connection has closed: drops anything
+ * still to be sent, waits for its writer thread, if it has one, to exit
+ * and removes it from the neighbour table. It is freed once no other
+ * thread can reach it. Called by whatever reads from the neighbour, which
+ * must not use it afterwards.
  */
-void add_neighbour(Depot* depot, Neighbour* neighbour, char* imMessage) {
-    char* port;
-    char* name;
-    if (!parse_im_message(imMessage, &port, &name)) {
-        fclose(neighbour->toNeighbour);
-        fclose(neighbour->fromNeighbour);
-    }
-    neighbour->port = port;
-    neighbour->neighbourName = name;
-    if (depot->numNeighbours == 0) {
-        depot->numNeighbours++;
-        depot->neighbours = (Neighbour*)malloc(depot->numNeighbours * 
-                sizeof(Neighbour));
-        depot->neighbours[depot->numNeighbours - 1] = *neighbour;
-    } else {
-        depot->numNeighbours++;
-        depot->neighbours = (Neighbour*)realloc(depot->neighbours, 
-                depot->numNeighbours * sizeof(Neighbour));
-        depot->neighbours[depot->numNeighbours - 1] = *neighbour;
+void close_neighbour(Neighbour* neighbour) {
+    Depot* depot = neighbour->depot;
+    __atomic_store_n(&neighbour->out.closed, true, __ATOMIC_SEQ_CST);
+    update_backlog(neighbour);
+    // Fails any write still blocked on the socket. It is only closed once
+    // the neighbour is freed, so a late sender cannot hit a reused socket.
+    shutdown(neighbour->reader.fd, SHUT_RDWR);
+    if (!neighbour->loop) {
+        uint64_t wake = 1;
+        write(neighbour->out.wakeFd, &wake, sizeof(uint64_t));
+        pthread_join(neighbour->writerID, NULL);
     }
+    __atomic_fetch_add(&depot->connectionsClosed, 1, __ATOMIC_RELAXED);
+    lock_depot();
+    remove_neighbour(depot, neighbour);
+    pthread_mutex_unlock(&depotLock);
 }
 
 /*
- * Adds the resource as described by the 'Deliver' message to the depots list
- * of resources
+ * Frees a closed neighbour once it has left every table a reader could
+ * still hold. A neighbour on an event loop is handed back to the loop, as
+ * it may still be on the loop's dirty list. Must be called while holding
+ * depotLock.
  */
-void add_resource(Depot* depot, char* deliverMessage) {
-    int quantity;
-    char* name;
-    if (!parse_deliver_withdraw_message(deliverMessage, &quantity, &name)) {
+void release_neighbour(Neighbour* neighbour) {
+    EventLoop* loop = neighbour->loop;
+    if (!loop) {
+        free_neighbour(neighbour);
         return;
     }
-    Resource resource = (Resource){quantity, name};
-    int depotContains = 0;
-    for (int i = 0; i < depot->numResources; i++) {
-        if (strcmp(resource.resourceName, depot->resources[i]
-                .resourceName) == 0) {
-            depotContains = 1;
-            depot->resources[i].quantity += resource.quantity;
-            break;
-        }
-    }
+    pthread_mutex_lock(&loop->lock);
+    neighbour->nextDeparted = loop->departed;
+    loop->departed = neighbour;
+    pthread_mutex_unlock(&loop->lock);
+    uint64_t wake = 1;
+    write(loop->wakeFd, &wake, sizeof(uint64_t));
+}
 
-    if (depotContains == 0) {
-        depot->numResources++;
-        depot->resources = (Resource*)realloc(depot->resources,
-                depot->numResources * sizeof(Resource));
-        depot->resources[depot->numResources - 1] = resource;
+/*
+ * Closes a neighbour's socket and frees it along with everything still
+ * queued for it
+ */
+void free_neighbour(Neighbour* neighbour) {
+    OutQueue* out = &neighbour->out;
+    discard_out_messages(out);
+    pthread_mutex_destroy(&out->lock);
+    free(out->wireIds);
+    free(out->iov);
+    if (out->wakeFd >= 0) {
+        close(out->wakeFd);
     }
+    close(neighbour->reader.fd);
+    free(neighbour->reader.buffer);
+    free(neighbour->reader.wireNames);
+    free(neighbour->port);
+    free(neighbour->advertised);
+    free(neighbour->routesSent);
+    free(neighbour);
 }
 
 /*
- * Withdraws the resource as described by the 'Withdraw' message from the
- * depot
+ * Parses a message from a neighbour and passes it to the relevent handler
+ * for its type, taking depotLock if the handler needs it
  */
-void withdraw_resource(Depot* depot, char* withdrawMessage) {
-    int quantity;
-    char* name;
-    if (!parse_deliver_withdraw_message(withdrawMessage, &quantity, &name)) {
+void handle_message(Neighbour* neighbour, char* message) {
+    long long start = now_ns();
+    Command command;
+    if (!parse_message(message, &command)) {
+        count(&thread_metrics()->parseFailures, 1);
         return;
     }
-    Resource resource = (Resource){quantity, name};
-    int depotContains = 0;
-    for (int i = 0; i < depot->numResources; i++) {
-        if (strcmp(resource.resourceName, depot->resources[i].resourceName) 
-                == 0) {
-            depotContains = 1;
-            depot->resources[i].quantity -= resource.quantity;
-            break;
-        }
-    }
-    if (depotContains == 0) {
-        depot->numResources++;
-        depot->resources = (Resource*)realloc(depot->resources, 
-                depot->numResources * sizeof(Resource));
-        depot->resources[depot->numResources - 1] = (Resource){.resourceName 
-                = resource.resourceName, .quantity = 0 - resource.quantity};
-    }
+    handle_command(neighbour, &command, start);
 }
 
 /*
- * Handles deferred messages by adding the task to a list of pending tasks
+ * Passes a message from a neighbour, parsed or decoded since the given
+ * time, to the handler for its type, taking depotLock if the handler needs
+ * it
  */
-void handle_defer_message(Depot* depot, char* deferMessage) {
-    unsigned key;
-    char* task;
-    if (!parse_defer_message(deferMessage, &key, &task)) {
+void handle_command(Neighbour* neighbour, Command* command, 
+        long long start) {
+    Depot* depot = neighbour->depot;
+    ThreadMetrics* metrics = thread_metrics();
+    command->source = neighbour;
+    if (command->type != CREDIT && credit_overrun(neighbour)) {
+        abandon_reader(&neighbour->reader);
         return;
     }
-    int containsKey = 0;
-    for (int i = 0; i < depot->numDeferredTasks; i++) {
-        if (depot->deferredTasks[i].key == key) {
-            containsKey = 1;
-            depot->deferredTasks[i].numTasks++;
-            depot->deferredTasks[i].tasks = (char**)realloc
-                    (depot->deferredTasks[i].tasks, depot->deferredTasks[i]
-                    .numTasks * sizeof(DeferredTask));
-            depot->deferredTasks[i].tasks[depot->deferredTasks[i].numTasks 
-                    - 1] = task;
-            break;
-        }
+    count(&metrics->messages[command->type], 1);
+    const CommandHandler* handler = &commandHandlers[command->type];
+    if (!handler->handle) {
+        return;
     }
-    if (containsKey == 0) {
-        DeferredTask deferredTask;
-        deferredTask.numTasks = 1;
-        deferredTask.key = key;
-        deferredTask.tasks = (char**)malloc(sizeof(char*));
-        deferredTask.tasks[deferredTask.numTasks - 1] = task;\
-        if (depot->numDeferredTasks == 0) {
-            depot->numDeferredTasks++;
-            depot->deferredTasks = (DeferredTask*)malloc
-                    (depot->numDeferredTasks * sizeof(DeferredTask));
-        } else {
-            depot->numDeferredTasks++;
-            depot->deferredTasks = (DeferredTask*)realloc
-                    (depot->deferredTasks, depot->numDeferredTasks * 
-                    sizeof(DeferredTask));
-        }
-        depot->deferredTasks[depot->numDeferredTasks - 1] = deferredTask;
+    if (handler->needsLock) {
+        lock_depot();
     }
+    handler->handle(depot, command);
+    if (handler->needsLock) {
+        pthread_mutex_unlock(&depotLock);
+    }
+    record_time(&metrics->latency[command->type], now_ns() - start);
 }
 
 /*
- * Executes the deferred task as described by the 'Execute' message
+ * Takes depotLock, counting how long the calling thread waited for it
  */
-void handle_execute(Depot* depot, char* executeMessage) {
-    unsigned key;
-    if (!parse_execute_message(executeMessage, &key)) {
-        return;
-    }
-    for (int i = 0; i < depot->numDeferredTasks; i++) {
-        if (depot->deferredTasks[i].key == key) {
-            for (int j = 0; j < depot->deferredTasks[i].numTasks; j++) {
-                if (determine_message_type(depot->deferredTasks[i].tasks[j]) 
-                        == DELIVER) {
-                    add_resource(depot, depot->deferredTasks[i].tasks[j]);
-                }
-                if (determine_message_type(depot->deferredTasks[i].tasks[j]) 
-                        == WITHDRAW) {
-                    withdraw_resource(depot, depot->deferredTasks[i].tasks[j]);
-                }
-                if (determine_message_type(depot->deferredTasks[i].tasks[j]) 
-                        == TRANSFER) {
-                    handle_transfer_message(depot, depot->deferredTasks[i].
-                            tasks[j]);
-                }
-            }
-            depot->deferredTasks[i].numTasks = 0;
-            depot->deferredTasks[i].tasks = NULL;
+void lock_depot(void) {
+    ThreadMetrics* metrics = thread_metrics();
+    long long waitStart = now_ns();
+    pthread_mutex_lock(&depotLock);
+    count(&metrics->lockAcquisitions, 1);
+    count(&metrics->lockWaitNs, now_ns() - waitStart);
+}
 
-        }
-    }
+/*
+ * Starts the thread which makes outbound connections
+ */
+void init_connector(Depot* depot) {
+    Connector* connector = &depot->connector;
+    connector->epollFd = epoll_create1(0);
+    connector->wakeFd = eventfd(0, EFD_NONBLOCK);
+    connector->handshakes = NULL;
+    pthread_mutex_init(&connector->lock, NULL);
+    struct epoll_event event;
+    memset(&event, 0, sizeof(struct epoll_event));
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    epoll_ctl(connector->epollFd, EPOLL_CTL_ADD, connector->wakeFd, &event);
+    pthread_create(&connector->threadID, NULL, connector_loop, 
+            (void*)depot);
 }
 
 /*
- * Handles incoming connect messages by connecting to the given depot
+ * Queues a connection to the given port for the connector, unless one is
+ * already under way
  */
-void handle_connect_message(Depot* depot, char* connectMessage) {
-    char* port;
-    if (!parse_connect_message(connectMessage, &port)) {
-        return;
-    }
-    bool containsPort = false;
-    for (int i = 0; i < depot->numNeighbours; i++) {
-        if (strcmp(port, depot->neighbours[i].port) == 0) {
-            containsPort = true;
+void request_connect(Depot* depot, Field port) {
+    Connector* connector = &depot->connector;
+    pthread_mutex_lock(&connector->lock);
+    for (Handshake* other = connector->handshakes; other; 
+            other = other->next) {
+        // Accepted connections have no port until their IM arrives
+        if (other->port && field_equals(port, other->port)) {
+            pthread_mutex_unlock(&connector->lock);
+            return;
         }
     }
-    if (containsPort == true) {
-        return;
-    }
-    struct addrinfo* ai = 0;
-    struct addrinfo hints;
-    memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-    getaddrinfo(LOCALHOST, port, &hints, &ai);
-    int connFd = socket(AF_INET, SOCK_STREAM, 0);
-    connect(connFd, (struct sockaddr*)ai->ai_addr, sizeof(struct sockaddr));
+    Handshake* handshake = (Handshake*)calloc(1, sizeof(Handshake));
+    handshake->state = QUEUED;
+    handshake->port = strndup(port.start, port.length);
+    handshake->next = connector->handshakes;
+    connector->handshakes = handshake;
+    pthread_mutex_unlock(&connector->lock);
+    uint64_t wake = 1;
+    write(connector->wakeFd, &wake, sizeof(uint64_t));
+}
 
-    Neighbour* neighbour = (Neighbour*)malloc(sizeof(Neighbour));
-    neighbour->depot = depot;
-    int connFdIn = dup(connFd);
-    neighbour->toNeighbour = fdopen(connFd, "w");
-    neighbour->fromNeighbour = fdopen(connFdIn, "r");
-    fprintf(neighbour->toNeighbour, "IM:%s:%s\n", depot->port, 
-            depot->depotName);
-    fflush(neighbour->toNeighbour);
-    char* imMessage = read_line(neighbour->fromNeighbour, 10);
-    if (determine_message_type(imMessage) == IM) {
-        add_neighbour(depot, neighbour, imMessage);
-    } else {
-        fclose(neighbour->toNeighbour);
-        fclose(neighbour->fromNeighbour);
-    }
-    pthread_create(&neighbour->threadID, NULL, conn_handler, 
-            (void*)neighbour);
+/*
+ * Hands a newly accepted, non-blocking connection to the connector, which
+ * waits for its IM for up to DEPOT_HANDSHAKE_TIMEOUT_MS
+ */
+void accept_handshake(Depot* depot, int connFd) {
+    Connector* connector = &depot->connector;
+    Handshake* handshake = (Handshake*)calloc(1, sizeof(Handshake));
+    handshake->state = ACCEPTED;
+    handshake->deadline = now_ms() + depot->config.handshakeTimeout;
+    init_line_reader(&handshake->reader, connFd);
+    pthread_mutex_lock(&connector->lock);
+    handshake->next = connector->handshakes;
+    connector->handshakes = handshake;
+    pthread_mutex_unlock(&connector->lock);
+    struct epoll_event event;
+    memset(&event, 0, sizeof(struct epoll_event));
+    event.events = EPOLLIN;
+    event.data.ptr = handshake;
+    epoll_ctl(connector->epollFd, EPOLL_CTL_ADD, connFd, &event);
+    // The connector has a new deadline to wait for
+    uint64_t wake = 1;
+    write(connector->wakeFd, &wake, sizeof(uint64_t));
 }
 
 /*
- * Transfer goods from the current depot to the depot as described by
- * the 'Transfer' message
+ * Connector thread which drives every handshake until it either becomes
+ * a neighbour, fails or runs out of time
  */
-void handle_transfer_message(Depot* depot, char* transferMessage) {
-    int quantity;
-    char* name;
-    char* dest;
-    if (!parse_transfer_message(transferMessage, &quantity, &name, &dest)) {
-        return;
-    }
-    int quantityLength = snprintf(NULL, 0, "%d", quantity);
-    char* withdrawMessage = (char*)malloc(strlen(name) + quantityLength + 11);
-    snprintf(withdrawMessage, strlen(name) + quantityLength + 11, 
-            "Withdraw:%d:%s\n", quantity, name);
-    withdraw_resource(depot, withdrawMessage);
-    for (int i = 0; i < depot->numNeighbours; i++) {
-        if (strcmp(dest, depot->neighbours[i].neighbourName) == 0) {
-            fprintf(depot->neighbours[i].toNeighbour, "Deliver:%d:%s\n", 
-                    quantity, name);
-            fflush(depot->neighbours[i].toNeighbour);
+void* connector_loop(void* param) {
+    Depot* depot = (Depot*)param;
+    Connector* connector = &depot->connector;
+    struct epoll_event events[EVENT_BATCH];
+    while (1) {
+        int timeout = service_handshakes(depot);
+        int ready = epoll_wait(connector->epollFd, events, EVENT_BATCH, 
+                timeout);
+        for (int i = 0; i < ready; i++) {
+            Handshake* handshake = (Handshake*)events[i].data.ptr;
+            if (!handshake) {
+                uint64_t wakes;
+                read(connector->wakeFd, &wakes, sizeof(uint64_t));
+                continue;
+            }
+            HandshakeResult result = advance_handshake(depot, handshake);
+            if (result != HANDSHAKE_PENDING) {
+                end_handshake(depot, handshake, result == HANDSHAKE_FAILED);
+            }
         }
     }
+    return 0;
 }
-                    
+
 /*
- * Extract the relevent information from both the deliver and withdraw
- * message and return whether or not the message is valid
+ * Starts any queued handshakes and abandons those which have run out of
+ * time. Returns how long the connector may wait before calling again.
  */
-bool parse_deliver_withdraw_message(char* message, int* quantity, 
-        char** name) {
-    if (strtok(message, ":") == NULL) {
-        return false;
-    }
-    char* err;
-    char* quantityToParse;
-    if (!(quantityToParse = strtok(NULL, ":"))) {
-        return false;
-    }
-    int quantityMessage = strtoul(quantityToParse, &err, 10);
-    if (strlen(quantityToParse) == 0 || *err != '\0') {
-        return false;
-    }
-    if (quantityMessage <= 0) {
-        return false;
-    }
-    char* nameMessage;
-    if (!(nameMessage = strtok(NULL, ":"))) {
-        return false;
-    }
-    if (strtok(NULL, ":") != NULL) {
-        return false;
+int service_handshakes(Depot* depot) {
+    Connector* connector = &depot->connector;
+    long long now = now_ms();
+    long long wait = -1;
+    pthread_mutex_lock(&connector->lock);
+    Handshake* next;
+    for (Handshake* handshake = connector->handshakes; handshake; 
+            handshake = next) {
+        next = handshake->next;
+        if (handshake->state == QUEUED) {
+            handshake->deadline = now + depot->config.handshakeTimeout;
+            if (!start_handshake(depot, handshake)) {
+                handshake->deadline = now;
+            }
+        }
+        if (handshake->deadline <= now) {
+            pthread_mutex_unlock(&connector->lock);
+            end_handshake(depot, handshake, true);
+            pthread_mutex_lock(&connector->lock);
+        } else if (wait < 0 || handshake->deadline - now < wait) {
+            wait = handshake->deadline - now;
+        }
     }
-    *quantity = quantityMessage;
-    *name = nameMessage;
-    return true;
+    pthread_mutex_unlock(&connector->lock);
+    return (int)wait;
 }
 
 /*
- * Extract the relevent information from the IM message and return whether
- * or not the message is valid
+ * Begins a non-blocking connect to the handshake's port. Returns false if
+ * the connection could not be started.
  */
-bool parse_im_message(char* imMessage, char** port, char** name) {
-    if (strtok(imMessage, ":") == NULL) {
-        return false;
-    }
-    char* portMessage;
-    if (!(portMessage = strtok(NULL, ":"))) {
-        return false;
-    }
-    char* nameMessage;
-    if (!(nameMessage = strtok(NULL, ":"))) {
+bool start_handshake(Depot* depot, Handshake* handshake) {
+    struct addrinfo* ai = 0;
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    init_line_reader(&handshake->reader, 
+            socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0));
+    // The IM is followed by this depot's capabilities, which the other
+    // depot answers with its own if it understands them
+    int imLength = snprintf(NULL, 0, "IM:%s:%s\n%s", depot->port, 
+            depot->depotName, depot->capsMessage);
+    handshake->imMessage = (char*)malloc(imLength + 1);
+    snprintf(handshake->imMessage, imLength + 1, "IM:%s:%s\n%s", 
+            depot->port, depot->depotName, depot->capsMessage);
+    handshake->state = CONNECTING;
+    if (handshake->reader.fd < 0 || 
+            getaddrinfo(LOCALHOST, handshake->port, &hints, &ai) != 0) {
         return false;
     }
-    if (strtok(NULL, ":") != NULL) {
+    int result = connect(handshake->reader.fd, (struct sockaddr*)ai->ai_addr, 
+            sizeof(struct sockaddr));
+    freeaddrinfo(ai);
+    if (result < 0 && errno != EINPROGRESS) {
         return false;
     }
-    *port = portMessage;
-    *name = nameMessage;
-    return true;
+    struct epoll_event event;
+    memset(&event, 0, sizeof(struct epoll_event));
+    event.events = EPOLLOUT;
+    event.data.ptr = handshake;
+    return epoll_ctl(depot->connector.epollFd, EPOLL_CTL_ADD, 
+            handshake->reader.fd, &event) == 0;
 }
 
 /*
- * Extract the relevent information from the deferred message and return
- * whether or not the message is valid
+ * Moves a handshake on once its socket is ready: sending our IM once the
+ * connection is up, then waiting for the peer's IM in reply
  */
-bool parse_defer_message(char* deferMessage, unsigned* key, char** task) {
-    if (strtok(deferMessage, ":") == NULL) {
-        return false;
+HandshakeResult advance_handshake(Depot* depot, Handshake* handshake) {
+    int fd = handshake->reader.fd;
+    if (handshake->state == AWAITING_IM || handshake->state == ACCEPTED) {
+        return read_handshake(depot, handshake);
     }
-    char* err;
-    char* keyToParse;
-    if (!(keyToParse = strtok(NULL, ":"))) {
-        return false;
+    int error = 0;
+    socklen_t length = sizeof(int);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || 
+            error != 0) {
+        return HANDSHAKE_FAILED;
     }
-    unsigned keyMessage = strtoul(keyToParse, &err, 10);
-    if (strlen(keyToParse) == 0 || *err != '\0') {
-        return false;
+    size_t imLength = strlen(handshake->imMessage);
+    ssize_t sent = send(fd, handshake->imMessage + handshake->imSent, 
+            imLength - handshake->imSent, MSG_NOSIGNAL);
+    if (sent < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK ? HANDSHAKE_PENDING : 
+                HANDSHAKE_FAILED;
     }
-    char* taskMessage;
-    if (!(taskMessage = strtok(NULL, ""))) {
-        return false;
+    if ((handshake->imSent += sent) == imLength) {
+        handshake->state = AWAITING_IM;
+        struct epoll_event event;
+        memset(&event, 0, sizeof(struct epoll_event));
+        event.events = EPOLLIN;
+        event.data.ptr = handshake;
+        epoll_ctl(depot->connector.epollFd, EPOLL_CTL_MOD, fd, &event);
     }
-    *key = keyMessage;
-    *task = taskMessage;
-    return true;
+    return HANDSHAKE_PENDING;
 }
 
 /*
- * Extract the relevent information from the execute message and return
- * whether or not the message is valid
+ * Reads what the peer has sent so far, publishing it as a neighbour once
+ * its IM has arrived
  */
-bool parse_execute_message(char* executeMessage, unsigned* key) {
-    if (strtok(executeMessage, ":") == NULL) {
-        return false;
-    }
-    char* err;
-    char* keyToParse;
-    if (!(keyToParse = strtok(NULL, ":"))) {
-        return false;
-    }
-    unsigned keyMessage = strtoul(keyToParse, &err, 10);
-    if (strlen(keyToParse) == 0 || *err != '\0') {
-        return false;
-    }
-    if (strtok(NULL, ":") != NULL) {
-        return false;
+HandshakeResult read_handshake(Depot* depot, Handshake* handshake) {
+    while (1) {
+        char* line = take_line(&handshake->reader);
+        if (line) {
+            return publish_neighbour(depot, handshake, line) ? 
+                    HANDSHAKE_DONE : HANDSHAKE_FAILED;
+        }
+        if (handshake->reader.eof) {
+            return HANDSHAKE_FAILED;
+        }
+        if (fill_line_reader(&handshake->reader, MSG_DONTWAIT) < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 
+                    HANDSHAKE_PENDING : HANDSHAKE_FAILED;
+        }
     }
-    *key = keyMessage;
-    return true;
 }
 
 /*
- * Extract the relevent information from the connect message and return
- * whether or not the message is valid
+ * Registers the other end of a finished handshake as a neighbour, holding
+ * depotLock only while doing so, and answers an accepted connection's IM
+ * with our own. Returns false if the IM is invalid or the depot is already
+ * connected to the port it connected to.
  */
-bool parse_connect_message(char* connectMessage, char** port) {
-    if (strtok(connectMessage, ":") == NULL) {
+bool publish_neighbour(Depot* depot, Handshake* handshake, char* imMessage) {
+    Command im;
+    if (!parse_message(imMessage, &im) || im.type != IM) {
         return false;
     }
-    char* portMessage;
-    if (!(portMessage = strtok(NULL, ":"))) {
+    int fd = handshake->reader.fd;
+    epoll_ctl(depot->connector.epollFd, EPOLL_CTL_DEL, fd, NULL);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    bool accepted = handshake->state == ACCEPTED;
+    lock_depot();
+    if (!accepted && has_neighbour_port(depot, 
+            (Field){handshake->port, strlen(handshake->port)})) {
+        pthread_mutex_unlock(&depotLock);
         return false;
     }
-    if (strtok(NULL, ":") != NULL) {
-        return false;
+    Neighbour* neighbour = open_neighbour(depot, fd, &handshake->reader);
+    if (accepted) {
+        // Our IM has to be queued before anything the neighbour has
+        // already sent, such as its Caps, is handled and answered
+        send_message(neighbour, "IM:%s:%s\n", depot->port, 
+                depot->depotName);
+    } else {
+        // Our capabilities went out with the IM, so the neighbour counts
+        // everything queued against its credit
+        neighbour->capsSent = true;
+        neighbour->out.counting = true;
     }
-    *port = portMessage;
+    add_neighbour(depot, neighbour, &im);
+    start_neighbour(neighbour);
+    pthread_mutex_unlock(&depotLock);
     return true;
 }
 
 /*
- * Extract the relevent information from the transfer message and return
- * whether or not the message is valid
+ * Removes a handshake from the connector, closing its socket unless it
+ * now belongs to a neighbour
  */
-bool parse_transfer_message(char* transferMessage, int* quantity, char** name,
-        char** dest) {
-    if (strtok(transferMessage, ":") == NULL) {
-        return false;
-    }
-    char* err;
-    char* quantityToParse;
-    if (!(quantityToParse = strtok(NULL, ":"))) {
-        return false;
+void end_handshake(Depot* depot, Handshake* handshake, bool closeSocket) {
+    Connector* connector = &depot->connector;
+    pthread_mutex_lock(&connector->lock);
+    Handshake** link = &connector->handshakes;
+    while (*link != handshake) {
+        link = &(*link)->next;
     }
-    int quantityMessage = strtoul(quantityToParse, &err, 10);
-    if (strlen(quantityToParse) == 0 || *err != '\0') {
-        return false;
-    }
-    char* nameMessage;
-    if (!(nameMessage = strtok(NULL, ":"))) {
-        return false;
-    }
-    char* destMessage;
-    if (!(destMessage = strtok(NULL, ":"))) {
-        return false;
-    }
-    if (strtok(NULL, ":") != NULL) {
-        return false;
+    *link = handshake->next;
+    pthread_mutex_unlock(&connector->lock);
+    if (closeSocket && handshake->state != QUEUED) {
+        if (handshake->reader.fd >= 0) {
+            epoll_ctl(connector->epollFd, EPOLL_CTL_DEL, 
+                    handshake->reader.fd, NULL);
+            close(handshake->reader.fd);
+        }
+        free(handshake->reader.buffer);
     }
-    *quantity = quantityMessage;
-    *name = nameMessage;
-    *dest = destMessage;
-    return true;
+    free(handshake->imMessage);
+    free(handshake->port);
+    free(handshake);
 }
 
 /*
- * Initialises the thread used for handling signals
+ * Check for whether or not the depot already has a neighbour on the given
+ * port. Safe to call without holding any lock.
  */
-void init_sig(Depot* depot) {
-    pthread_t tid;
-    sigset_t set;
-    sigemptyset(&set);
-    sigaddset(&set, SIGHUP);
-    sigaddset(&set, SIGPIPE);
-    pthread_sigmask(SIG_BLOCK, &set, 0);
-    pthread_create(&tid, 0, handle_signals, 0);
+bool has_neighbour_port(Depot* depot, Field port) {
+    rcu_read_lock();
+    bool found = find_neighbour_port(read_neighbours(depot), port) != NULL;
+    rcu_read_unlock();
+    return found;
 }
 
 /*
- * Signal handler for catching SIGHUP and SIGPIPE
+ * Current time in milliseconds from a monotonic clock
  */
-void* handle_signals(void* arg) {
-    sigset_t set;
-    sigemptyset(&set);
-    sigaddset(&set, SIGHUP);
-    sigaddset(&set, SIGPIPE);
-    int sigNum;
-    while (!sigwait(&set, &sigNum)) {
-        if (sigNum == 1) {
-            pthread_mutex_lock(&depotLock);
-            print_info(depotCpy);
-            pthread_mutex_unlock(&depotLock);
+long long now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*
+ * Creates the epoll workers requested by DEPOT_EVENT_WORKERS. With none
+ * requested each neighbour gets its own conn_handler thread instead.
+ */
+void init_event_loops(Depot* depot) {
+    if (depot->config.eventWorkers <= 0) {
+        return;
+    }
+    depot->eventLoops = (EventLoop*)malloc(sizeof(EventLoop) * 
+            depot->config.eventWorkers);
+    for (int i = 0; i < depot->config.eventWorkers; i++) {
+        EventLoop* loop = &depot->eventLoops[i];
+        loop->depot = depot;
+        loop->epollFd = epoll_create1(0);
+        loop->wakeFd = eventfd(0, EFD_NONBLOCK);
+        pthread_mutex_init(&loop->lock, NULL);
+        loop->numAdopted = 0;
+        loop->adoptedCapacity = 0;
+        loop->adopted = NULL;
+        loop->dirty = NULL;
+        loop->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        loop->timerArmed = false;
+        loop->departed = NULL;
+        loop->ring = NULL;
+        loop->numHeld = 0;
+        loop->heldCapacity = 0;
+        loop->held = NULL;
+#ifdef DEPOT_URING
+        if (depot->config.uring && (loop->ring = open_ring(true))) {
+            ring_poll(loop->ring, loop->wakeFd, URING_WAKE);
+            ring_poll(loop->ring, loop->timerFd, URING_TIMER);
+            pthread_create(&loop->threadID, NULL, uring_loop, (void*)loop);
+            continue;
+        }
+        if (depot->config.uring) {
+            fputs("depot: io_uring unavailable, using epoll\n", stderr);
+            depot->config.uring = false;
         }
+#endif
+        struct epoll_event event;
+        memset(&event, 0, sizeof(struct epoll_event));
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, loop->wakeFd, &event);
+        event.data.ptr = &loop->timerFd;
+        epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, loop->timerFd, &event);
+        pthread_create(&loop->threadID, NULL, event_loop, (void*)loop);
     }
-    return 0;
+    depot->numEventLoops = depot->config.eventWorkers;
 }
 
 /*
- * Custom comparator for comparing resources
+ * Event loop which services every neighbour registered with it, handling
+ * each complete line as it arrives
  */
-int comp_resources(const void* v1, const void* v2) {
-    Resource x1 = *((Resource*)v1);
-    Resource x2 = *((Resource*)v2);
-    return strcmp(x1.resourceName, x2.resourceName);
+void* event_loop(void* param) {
+    EventLoop* loop = (EventLoop*)param;
+    struct epoll_event events[EVENT_BATCH];
+    while (1) {
+        int ready = epoll_wait(loop->epollFd, events, EVENT_BATCH, -1);
+        for (int i = 0; i < ready; i++) {
+            uint64_t wakes;
+            if (events[i].data.ptr == &loop->timerFd) {
+                read(loop->timerFd, &wakes, sizeof(uint64_t));
+                loop->timerArmed = false;
+                flush_dirty(loop);
+            } else if (events[i].data.ptr) {
+                service_neighbour(loop, (Neighbour*)events[i].data.ptr, 
+                        events[i].events);
+            } else {
+                read(loop->wakeFd, &wakes, sizeof(uint64_t));
+                adopt_neighbours(loop);
+                resume_held(loop);
+                schedule_flush(loop);
+                free_departed(loop);
+            }
+        }
+    }
+    return 0;
 }
 
 /*
- * Custom comparator for comparing neighbours
+ * Registers the neighbours newly handed to the loop and handles any lines
+ * they already have buffered
  */
-int comp_neighbours(const void* v1, const void* v2) {
-    Neighbour x1 = *((Neighbour*)v1);
-    Neighbour x2 = *((Neighbour*)v2);
-    return strcmp(x1.neighbourName, x2.neighbourName);
+void adopt_neighbours(EventLoop* loop) {
+    pthread_mutex_lock(&loop->lock);
+    int numAdopted = loop->numAdopted;
+    Neighbour** adopted = loop->adopted;
+    loop->numAdopted = 0;
+    loop->adoptedCapacity = 0;
+    loop->adopted = NULL;
+    pthread_mutex_unlock(&loop->lock);
+    for (int i = 0; i < numAdopted; i++) {
+#ifdef DEPOT_URING
+        if (loop->ring) {
+            uring_recv(loop, adopted[i]);
+            dispatch_lines(adopted[i]);
+            if (reader_held(adopted[i])) {
+                hold_neighbour(loop, adopted[i]);
+            }
+            continue;
+        }
+#endif
+        struct epoll_event event;
+        memset(&event, 0, sizeof(struct epoll_event));
+        // Sending may already have stalled before the neighbour arrived
+        event.events = EPOLLIN | (adopted[i]->out.blocked ? EPOLLOUT : 0);
+        event.data.ptr = adopted[i];
+        epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, adopted[i]->reader.fd, 
+                &event);
+        dispatch_lines(adopted[i]);
+        if (reader_held(adopted[i])) {
+            hold_neighbour(loop, adopted[i]);
+        }
+    }
+    free(adopted);
 }
 
 /*
- * Reads up until newline or EOF from the given file and stores as a string
+ * Frees the closed neighbours handed back to the loop, first flushing its
+ * dirty list so that none of them is left on it
  */
-char* read_line(FILE* file, size_t size) {
-    char* strResult;
-    int ch;
-
-    size_t length = 0;
-    strResult = (char*)malloc(sizeof(char) * size);
-    if (!strResult) {
-        return strResult;
+void free_departed(EventLoop* loop) {
+    pthread_mutex_lock(&loop->lock);
+    Neighbour* neighbour = loop->departed;
+    loop->departed = NULL;
+    pthread_mutex_unlock(&loop->lock);
+    if (!neighbour) {
+        return;
     }
-    while(EOF != (ch = fgetc(file)) && ch != '\n') {
-        strResult[length++] = ch;
-        if (length == size) {
-            strResult = (char*)realloc(strResult, sizeof(char) * (size += 16));
-            if (!strResult) {
-                return strResult;
-            }
+    flush_dirty(loop);
+    while (neighbour) {
+        Neighbour* next = neighbour->nextDeparted;
+        if (neighbour->out.inFlight) {
+            // Its io_uring send has yet to complete, which wakes the loop
+            // to try again
+            pthread_mutex_lock(&loop->lock);
+            neighbour->nextDeparted = loop->departed;
+            loop->departed = neighbour;
+            pthread_mutex_unlock(&loop->lock);
+        } else {
+            free_neighbour(neighbour);
         }
+        neighbour = next;
+    }
+}
+
+/*
+ * Writes out the queued messages of every neighbour on the loop which has
+ * been sent something since it was last flushed
+ */
+void flush_dirty(EventLoop* loop) {
+    Neighbour* neighbour = __atomic_exchange_n(&loop->dirty, NULL, 
+            __ATOMIC_ACQUIRE);
+    while (neighbour) {
+        // Once signalled is cleared the neighbour may be pushed again
+        Neighbour* next = neighbour->nextDirty;
+        __atomic_store_n(&neighbour->out.signalled, false, __ATOMIC_SEQ_CST);
+        flush_neighbour(loop, neighbour);
+        neighbour = next;
+    }
+}
+
+/*
+ * Flushes the dirty neighbours now, or once the coalescing window has
+ * passed so that a burst of deliveries can be merged first
+ */
+void schedule_flush(EventLoop* loop) {
+    int window = loop->depot->config.coalesceWindow;
+    if (window <= 0) {
+        flush_dirty(loop);
+        return;
+    }
+    if (loop->timerArmed) {
+        return;
+    }
+    struct itimerspec timer;
+    memset(&timer, 0, sizeof(struct itimerspec));
+    timer.it_value.tv_sec = window / 1000000;
+    timer.it_value.tv_nsec = (window % 1000000) * 1000;
+    timerfd_settime(loop->timerFd, 0, &timer, NULL);
+    loop->timerArmed = true;
+}
+
+/*
+ * Writes out as much of a neighbour's queue as its socket will take
+ * without blocking, asking epoll to say when it can take the rest
+ */
+void flush_neighbour(EventLoop* loop, Neighbour* neighbour) {
+#ifdef DEPOT_URING
+    if (loop->ring) {
+        uring_send(loop, neighbour);
+        update_backlog(neighbour);
+        return;
+    }
+#endif
+    pthread_mutex_lock(&neighbour->out.lock);
+    bool blocked = !flush_out_queue(neighbour, MSG_DONTWAIT);
+    pthread_mutex_unlock(&neighbour->out.lock);
+    update_backlog(neighbour);
+    watch_neighbour(loop, neighbour, blocked);
+}
+
+/*
+ * Sets whether the loop waits for a neighbour's socket to become writable
+ * as well as readable, unless reading from it is held back
+ */
+void watch_neighbour(EventLoop* loop, Neighbour* neighbour, bool writing) {
+    if (neighbour->out.blocked == writing) {
+        return;
+    }
+    neighbour->out.blocked = writing;
+    struct epoll_event event;
+    memset(&event, 0, sizeof(struct epoll_event));
+    event.events = (neighbour->held ? 0 : EPOLLIN) | 
+            (writing ? EPOLLOUT : 0);
+    event.data.ptr = neighbour;
+    epoll_ctl(loop->epollFd, EPOLL_CTL_MOD, neighbour->reader.fd, &event);
+}
+
+/*
+ * Sends whatever a neighbour's socket can now take, then reads and handles
+ * everything available from it, dropping it from the loop and tearing it
+ * down once its connection has closed
+ */
+void service_neighbour(EventLoop* loop, Neighbour* neighbour, 
+        uint32_t events) {
+    if (events & EPOLLOUT) {
+        flush_neighbour(loop, neighbour);
+    }
+    if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+        return;
+    }
+    // A connection which has gone is read to the end even while reading
+    // from it is held back, as epoll would otherwise keep reporting it
+    bool gone = events & (EPOLLHUP | EPOLLERR);
+    ssize_t got;
+    while ((got = fill_line_reader(&neighbour->reader, MSG_DONTWAIT)) > 0) {
+        dispatch_lines(neighbour);
+        if (!gone && reader_held(neighbour)) {
+            hold_neighbour(loop, neighbour);
+            return;
+        }
+    }
+    if (got == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+        dispatch_lines(neighbour);
+        drop_held(loop, neighbour);
+        epoll_ctl(loop->epollFd, EPOLL_CTL_DEL, neighbour->reader.fd, NULL);
+        close_neighbour(neighbour);
+    }
+}
+
+/*
+ * Stops reading from a neighbour until the depot's backlog drains, keeping
+ * it on the loop's list to look at again each time the loop is woken
+ */
+void hold_neighbour(EventLoop* loop, Neighbour* neighbour) {
+    if (neighbour->held) {
+        return;
+    }
+    neighbour->held = true;
+    if (loop->numHeld == loop->heldCapacity) {
+        loop->heldCapacity = loop->heldCapacity * 2 + 1;
+        loop->held = (Neighbour**)realloc(loop->held, 
+                sizeof(Neighbour*) * loop->heldCapacity);
+    }
+    loop->held[loop->numHeld++] = neighbour;
+#ifdef DEPOT_URING
+    if (loop->ring) {
+        if (neighbour->receiving) {
+            struct io_uring_sqe* sqe = ring_sqe(loop->ring, NULL, 
+                    URING_CANCEL);
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = (uint64_t)(uintptr_t)neighbour | URING_RECV;
+        }
+        return;
+    }
+#endif
+    struct epoll_event event;
+    memset(&event, 0, sizeof(struct epoll_event));
+    event.events = neighbour->out.blocked ? EPOLLOUT : 0;
+    event.data.ptr = neighbour;
+    epoll_ctl(loop->epollFd, EPOLL_CTL_MOD, neighbour->reader.fd, &event);
+}
+
+/*
+ * Takes a neighbour whose connection has closed off the loop's list of
+ * those it has stopped reading from
+ */
+void drop_held(EventLoop* loop, Neighbour* neighbour) {
+    if (!neighbour->held) {
+        return;
+    }
+    neighbour->held = false;
+    for (int i = 0; i < loop->numHeld; i++) {
+        if (loop->held[i] == neighbour) {
+            loop->held[i] = loop->held[--loop->numHeld];
+            break;
+        }
+    }
+}
+
+/*
+ * Starts reading again from each neighbour the loop stopped reading from
+ * which is no longer held back
+ */
+void resume_held(EventLoop* loop) {
+    int numHeld = 0;
+    for (int i = 0; i < loop->numHeld; i++) {
+        Neighbour* neighbour = loop->held[i];
+        if (reader_held(neighbour)) {
+            loop->held[numHeld++] = neighbour;
+            continue;
+        }
+        neighbour->held = false;
+#ifdef DEPOT_URING
+        if (loop->ring) {
+            // A receive still being cancelled is started again once it is
+            if (!neighbour->receiving) {
+                uring_recv(loop, neighbour);
+            }
+            continue;
+        }
+#endif
+        struct epoll_event event;
+        memset(&event, 0, sizeof(struct epoll_event));
+        event.events = EPOLLIN | (neighbour->out.blocked ? EPOLLOUT : 0);
+        event.data.ptr = neighbour;
+        epoll_ctl(loop->epollFd, EPOLL_CTL_MOD, neighbour->reader.fd, 
+                &event);
+    }
+    loop->numHeld = numHeld;
+}
+
+#ifdef DEPOT_URING
+/*
+ * Sets up an io_uring with its queues mapped into memory. A ring which is
+ * to receive also registers URING_BUFFERS buffers for the kernel to pick
+ * from as data arrives. Returns NULL if the kernel cannot provide this.
+ */
+Ring* open_ring(bool receiving) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(struct io_uring_params));
+    int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (fd < 0) {
+        return NULL;
+    }
+    size_t sqSize = params.sq_off.array + 
+            params.sq_entries * sizeof(unsigned);
+    size_t cqSize = params.cq_off.cqes + 
+            params.cq_entries * sizeof(struct io_uring_cqe);
+    size_t size = sqSize > cqSize ? sqSize : cqSize;
+    char* queues = MAP_FAILED;
+    struct io_uring_sqe* sqes = MAP_FAILED;
+    // Both queues share one mapping on every kernel with provided buffers
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        queues = mmap(NULL, size, PROT_READ | PROT_WRITE, 
+                MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 
+                IORING_OFF_SQES);
+    }
+    if (queues == MAP_FAILED || sqes == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    Ring* ring = (Ring*)calloc(1, sizeof(Ring));
+    ring->fd = fd;
+    ring->entries = params.sq_entries;
+    ring->sqHead = (unsigned*)(queues + params.sq_off.head);
+    ring->sqTail = (unsigned*)(queues + params.sq_off.tail);
+    ring->sqMask = *(unsigned*)(queues + params.sq_off.ring_mask);
+    ring->sqes = sqes;
+    ring->tail = *ring->sqTail;
+    // Each slot of the submission queue always holds the entry of the
+    // same index
+    unsigned* array = (unsigned*)(queues + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++) {
+        array[i] = i;
+    }
+    ring->cqHead = (unsigned*)(queues + params.cq_off.head);
+    ring->cqTail = (unsigned*)(queues + params.cq_off.tail);
+    ring->cqMask = *(unsigned*)(queues + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(queues + params.cq_off.cqes);
+    if (!receiving) {
+        return ring;
+    }
+
+    ring->bufRing = (struct io_uring_buf_ring*)mmap(NULL, 
+            sizeof(struct io_uring_buf) * URING_BUFFERS, 
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(struct io_uring_buf_reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->bufRing;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = 0;
+    if (ring->bufRing == MAP_FAILED || syscall(__NR_io_uring_register, fd,
+            IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        // Leaves the mappings, as a failed ring is only set up once
+        close(fd);
+        free(ring);
+        return NULL;
+    }
+    ring->buffers = (char*)malloc((size_t)URING_BUFFERS * 
+            URING_BUFFER_SIZE);
+    for (int i = 0; i < URING_BUFFERS; i++) {
+        provide_buffer(ring, i);
+    }
+    return ring;
+}
+
+/*
+ * Returns the next free submission queue entry, cleared and tagged with
+ * what its completion is for. The queue is submitted first if it is full.
+ */
+struct io_uring_sqe* ring_sqe(Ring* ring, void* owner, UringTag tag) {
+    while (ring->tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) == 
+            ring->entries) {
+        submit_ring(ring, 0);
+    }
+    struct io_uring_sqe* sqe = &ring->sqes[ring->tail++ & ring->sqMask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->user_data = (uint64_t)(uintptr_t)owner | tag;
+    return sqe;
+}
+
+/*
+ * Submits every entry queued on the ring, then waits until at least the
+ * given number of completions are ready
+ */
+void submit_ring(Ring* ring, unsigned waitFor) {
+    __atomic_store_n(ring->sqTail, ring->tail, __ATOMIC_RELEASE);
+    unsigned toSubmit = ring->tail - 
+            __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+    syscall(__NR_io_uring_enter, ring->fd, toSubmit, waitFor, 
+            waitFor ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+/*
+ * Hands a receive buffer back to the kernel to fill again
+ */
+void provide_buffer(Ring* ring, unsigned short bufferId) {
+    struct io_uring_buf* buffer = 
+            &ring->bufRing->bufs[ring->bufTail & (URING_BUFFERS - 1)];
+    buffer->addr = (uint64_t)(uintptr_t)(ring->buffers + 
+            (size_t)bufferId * URING_BUFFER_SIZE);
+    buffer->len = URING_BUFFER_SIZE;
+    buffer->bid = bufferId;
+    ring->bufTail++;
+    __atomic_store_n(&ring->bufRing->tail, ring->bufTail, __ATOMIC_RELEASE);
+}
+
+/*
+ * Asks the ring to complete each time the descriptor becomes readable
+ */
+void ring_poll(Ring* ring, int fd, UringTag tag) {
+    struct io_uring_sqe* sqe = ring_sqe(ring, NULL, tag);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+}
+
+/*
+ * Accepts connections with one multishot accept on an io_uring, handing
+ * each to the connector. Returns only if io_uring cannot be used, leaving
+ * the caller to accept them itself.
+ */
+void uring_accept(Depot* depot, int serv) {
+    Ring* ring = open_ring(false);
+    if (!ring) {
+        return;
+    }
+    bool armed = false;
+    while (1) {
+        if (!armed) {
+            struct io_uring_sqe* sqe = ring_sqe(ring, NULL, URING_ACCEPT);
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->fd = serv;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe->accept_flags = SOCK_NONBLOCK;
+            armed = true;
+        }
+        submit_ring(ring, 1);
+        unsigned head = *ring->cqHead;
+        while (head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe cqe = ring->cqes[head & ring->cqMask];
+            __atomic_store_n(ring->cqHead, ++head, __ATOMIC_RELEASE);
+            if (cqe.res >= 0) {
+                accept_handshake(depot, cqe.res);
+            } else if (cqe.res == -EINVAL) {
+                // Multishot accept is not supported
+                return;
+            } else if (cqe.res == -EMFILE || cqe.res == -ENFILE || 
+                    cqe.res == -ENOBUFS || cqe.res == -ENOMEM) {
+                poll(NULL, 0, 10);
+            }
+            if (!(cqe.flags & IORING_CQE_F_MORE)) {
+                armed = false;
+            }
+        }
+    }
+}
+
+/*
+ * Event loop which services its neighbours through an io_uring instead of
+ * epoll. Received data arrives already read into provided buffers and
+ * sends complete in the background, so the loop makes one system call for
+ * each batch of completions.
+ */
+void* uring_loop(void* param) {
+    EventLoop* loop = (EventLoop*)param;
+    Ring* ring = loop->ring;
+    while (1) {
+        submit_ring(ring, 1);
+        unsigned head = *ring->cqHead;
+        while (head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+            // Copied out so that the slot can be reused straight away
+            struct io_uring_cqe cqe = ring->cqes[head & ring->cqMask];
+            __atomic_store_n(ring->cqHead, ++head, __ATOMIC_RELEASE);
+            uring_completed(loop, &cqe);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Handles one completion from a loop's io_uring
+ */
+void uring_completed(EventLoop* loop, struct io_uring_cqe* cqe) {
+    Neighbour* neighbour = (Neighbour*)(uintptr_t)(cqe->user_data & 
+            ~(uint64_t)URING_TAG_MASK);
+    bool more = cqe->flags & IORING_CQE_F_MORE;
+    uint64_t wakes;
+    switch (cqe->user_data & URING_TAG_MASK) {
+        case URING_WAKE:
+            read(loop->wakeFd, &wakes, sizeof(uint64_t));
+            adopt_neighbours(loop);
+            resume_held(loop);
+            schedule_flush(loop);
+            free_departed(loop);
+            if (!more) {
+                ring_poll(loop->ring, loop->wakeFd, URING_WAKE);
+            }
+            break;
+        case URING_TIMER:
+            read(loop->timerFd, &wakes, sizeof(uint64_t));
+            loop->timerArmed = false;
+            flush_dirty(loop);
+            if (!more) {
+                ring_poll(loop->ring, loop->timerFd, URING_TIMER);
+            }
+            break;
+        case URING_RECV:
+            uring_received(loop, neighbour, cqe->res, cqe->flags);
+            break;
+        case URING_SEND:
+            uring_sent(loop, neighbour, cqe->res);
+            break;
+    }
+}
+
+/*
+ * Starts a multishot receive from the neighbour into the loop's provided
+ * buffers
+ */
+void uring_recv(EventLoop* loop, Neighbour* neighbour) {
+    struct io_uring_sqe* sqe = ring_sqe(loop->ring, neighbour, URING_RECV);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = neighbour->reader.fd;
+    neighbour->receiving = true;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+}
+
+/*
+ * Handles what a receive from the neighbour completed with, tearing the
+ * neighbour down once its connection has closed
+ */
+void uring_received(EventLoop* loop, Neighbour* neighbour, int result, 
+        unsigned flags) {
+    Ring* ring = loop->ring;
+    if (result > 0) {
+        unsigned short bufferId = flags >> IORING_CQE_BUFFER_SHIFT;
+        append_line_reader(&neighbour->reader, ring->buffers + 
+                (size_t)bufferId * URING_BUFFER_SIZE, result);
+        provide_buffer(ring, bufferId);
+        dispatch_lines(neighbour);
+        if (reader_held(neighbour)) {
+            hold_neighbour(loop, neighbour);
+        }
+    } else if (result != -ENOBUFS && result != -EINTR && 
+            result != -EAGAIN && result != -ECANCELED) {
+        neighbour->reader.eof = true;
+        dispatch_lines(neighbour);
+        drop_held(loop, neighbour);
+        close_neighbour(neighbour);
+        return;
+    }
+    // Running out of buffers ends a multishot receive, as can the kernel.
+    // One cancelled while reading is held back waits for the loop to
+    // resume it.
+    if (!(flags & IORING_CQE_F_MORE)) {
+        neighbour->receiving = false;
+        if (!neighbour->held) {
+            uring_recv(loop, neighbour);
+        }
+    }
+}
+
+/*
+ * Hands the neighbour's pending messages to the loop's io_uring to send,
+ * unless a send is already under way
+ */
+void uring_send(EventLoop* loop, Neighbour* neighbour) {
+    OutQueue* out = &neighbour->out;
+    pthread_mutex_lock(&out->lock);
+    if (!out->inFlight) {
+        take_out_messages(out);
+        queue_credit_grant(out);
+        if (!out->iov) {
+            out->iov = (struct iovec*)malloc(sizeof(struct iovec) * 
+                    OUT_BATCH);
+        }
+        int count = 0;
+        if (__atomic_load_n(&out->closed, __ATOMIC_ACQUIRE)) {
+            discard_out_messages(out);
+        } else {
+            // Nothing is gathered while waiting for credit or the log,
+            // unless the sync has just finished
+            do {
+                count = gather_out_messages(out, out->iov, 
+                        synced_lsn(neighbour->depot));
+            } while (count == 0 && out->awaitedLsn && 
+                    out->awaitedLsn <= synced_lsn(neighbour->depot));
+        }
+        if (count > 0) {
+            memset(&out->header, 0, sizeof(struct msghdr));
+            out->header.msg_iov = out->iov;
+            out->header.msg_iovlen = count;
+            struct io_uring_sqe* sqe = ring_sqe(loop->ring, neighbour, 
+                    URING_SEND);
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->fd = neighbour->reader.fd;
+            sqe->addr = (uint64_t)(uintptr_t)&out->header;
+            sqe->len = 1;
+            sqe->msg_flags = MSG_NOSIGNAL;
+            out->inFlight = true;
+        }
+    }
+    pthread_mutex_unlock(&out->lock);
+}
+
+/*
+ * Releases what a send to the neighbour wrote and starts the next one.
+ * Once the connection has failed the loop is woken to free the neighbour
+ * if it is waiting on this send.
+ */
+void uring_sent(EventLoop* loop, Neighbour* neighbour, int result) {
+    OutQueue* out = &neighbour->out;
+    pthread_mutex_lock(&out->lock);
+    out->inFlight = false;
+    if (result >= 0) {
+        release_out_messages(out, result);
+    } else if (result != -EAGAIN && result != -EINTR) {
+        __atomic_store_n(&out->closed, true, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&out->lock);
+    uring_send(loop, neighbour);
+    update_backlog(neighbour);
+    if (__atomic_load_n(&out->closed, __ATOMIC_ACQUIRE)) {
+        uint64_t wake = 1;
+        write(loop->wakeFd, &wake, sizeof(uint64_t));
+    }
+}
+
+/*
+ * Copies bytes received into a provided buffer onto the end of the
+ * reader's buffer, first discarding consumed lines and growing it if
+ * there is not room
+ */
+void append_line_reader(LineReader* reader, const char* bytes, 
+        size_t length) {
+    if (reader->start == reader->length) {
+        reader->start = 0;
+        reader->length = 0;
+    }
+    // A spare byte is always left for take_line's terminator
+    if (reader->length + length + 1 > reader->capacity) {
+        reader->length -= reader->start;
+        memmove(reader->buffer, reader->buffer + reader->start, 
+                reader->length);
+        reader->start = 0;
+        while (reader->length + length + 1 > reader->capacity) {
+            reader->capacity *= 2;
+        }
+        reader->buffer = (char*)realloc(reader->buffer, reader->capacity);
+    }
+    memcpy(reader->buffer + reader->length, bytes, length);
+    reader->length += length;
+    __atomic_store_n(&reader->received, reader->received + length, 
+            __ATOMIC_RELAXED);
+}
+#endif
+
+/*
+ * Handles each complete message in the neighbour's receive buffer
+ */
+void dispatch_lines(Neighbour* neighbour) {
+    dispatching = neighbour;
+    while (dispatch_message(neighbour)) {
+    }
+    flush_shard_batches(neighbour->depot);
+    dispatching = NULL;
+    __atomic_store_n(&neighbour->creditHandled, 
+            handled_bytes(&neighbour->reader), __ATOMIC_RELEASE);
+    replenish_credit(neighbour);
+}
+
+/*
+ * Adds to the credit waiting to be sent to the neighbour
+ */
+void grant_credit(Neighbour* neighbour, long long credit) {
+    __atomic_add_fetch(&neighbour->out.grant, credit, __ATOMIC_RELEASE);
+    wake_writer(neighbour);
+}
+
+/*
+ * Grants the neighbour more credit once this depot has handled half of
+ * what it was last granted, so that a neighbour which keeps up is never
+ * held back while one which does not can be at most a window ahead. None
+ * is granted while what the neighbour sent is adding to another
+ * neighbour's backlogged queue; reading from it carries on meanwhile so
+ * that its own grants still arrive. Safe to call from any thread.
+ */
+void replenish_credit(Neighbour* neighbour) {
+    if (!__atomic_load_n(&neighbour->granting, __ATOMIC_ACQUIRE) || 
+            (__atomic_load_n(&neighbour->feeding, __ATOMIC_RELAXED) && 
+            backlogged_elsewhere(neighbour))) {
+        return;
+    }
+    uint64_t handled = __atomic_load_n(&neighbour->creditHandled, 
+            __ATOMIC_ACQUIRE);
+    uint64_t granted = __atomic_load_n(&neighbour->creditGranted, 
+            __ATOMIC_RELAXED);
+    uint64_t due = handled - granted;
+    if (due < neighbour->depot->config.creditWindow / 2 || 
+            !__atomic_compare_exchange_n(&neighbour->creditGranted, 
+            &granted, handled, false, __ATOMIC_RELAXED, 
+            __ATOMIC_RELAXED)) {
+        return;
+    }
+    grant_credit(neighbour, due);
+}
+
+/*
+ * Whether the message being handled from the neighbour began beyond the
+ * window it was granted. The neighbour counts its bytes from the same
+ * point, after its 'Caps', and only ever overdraws with the last message
+ * it starts, so this never happens to a neighbour which keeps to its
+ * credit. Only called by whatever reads from the neighbour.
+ */
+bool credit_overrun(Neighbour* neighbour) {
+    return neighbour->granting && neighbour->messageStart >= 
+            __atomic_load_n(&neighbour->creditGranted, __ATOMIC_RELAXED) + 
+            neighbour->depot->config.creditWindow;
+}
+
+/*
+ * Handles the next complete message in the neighbour's receive buffer,
+ * which is a line until the neighbour switches to binary frames. Returns
+ * false if there is none.
+ */
+bool dispatch_message(Neighbour* neighbour) {
+    LineReader* reader = &neighbour->reader;
+    neighbour->messageStart = handled_bytes(reader);
+    if (!reader->binary) {
+        char* line = take_line(reader);
+        if (line) {
+            handle_message(neighbour, line);
+        }
+        return line != NULL;
+    }
+    ByteReader frame;
+    if (!take_frame(reader, &frame)) {
+        return false;
+    }
+    long long start = now_ns();
+    uint8_t type = get_u8(&frame);
+    if (type == FRAME_TEXT) {
+        // Move the text back over its type so it can be terminated in
+        // place
+        size_t length = frame.end - frame.next;
+        char* text = (char*)frame.next - 1;
+        memmove(text, frame.next, length);
+        text[length] = '\0';
+        if (memchr(text, '\n', length)) {
+            abandon_reader(reader);
+            return false;
+        }
+        handle_message(neighbour, text);
+        return true;
+    }
+    Command command;
+    if (!decode_frame(reader, type, &frame, &command)) {
+        count(&thread_metrics()->parseFailures, 1);
+        abandon_reader(reader);
+        return false;
+    }
+    handle_command(neighbour, &command, start);
+    return true;
+}
+
+/*
+ * Creates an empty queue of messages to send
+ */
+void init_out_queue(OutQueue* out, bool coalesce) {
+    out->stack = NULL;
+    out->queued = 0;
+    out->signalled = false;
+    out->closed = false;
+    out->sent = 0;
+    pthread_mutex_init(&out->lock, NULL);
+    out->pending = NULL;
+    out->pendingTail = NULL;
+    out->pendingSent = 0;
+    out->binary = false;
+    out->wireIds = NULL;
+    out->wireIdsSize = 0;
+    out->numWireIds = 0;
+    out->coalesce = coalesce;
+    out->wakeFd = -1;
+    out->blocked = false;
+    out->backlogged = false;
+    out->inFlight = false;
+    out->iov = NULL;
+    out->credit = 0;
+    out->limited = false;
+    out->grant = 0;
+    out->grantsQueued = 0;
+    out->counting = false;
+}
+
+/*
+ * Allocates an empty text message with room for the given number of bytes
+ */
+OutMessage* new_out_message(size_t capacity) {
+    OutMessage* message = (OutMessage*)malloc(sizeof(OutMessage) + 
+            capacity + 1);
+    message->task.type = INVALID;
+    message->length = 0;
+    message->charged = false;
+    message->lsn = 0;
+    return message;
+}
+
+/*
+ * Formats a message and queues it to be sent to the neighbour
+ */
+void send_message(Neighbour* neighbour, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    OutMessage* message = new_out_message(length);
+    va_start(args, format);
+    vsnprintf(message->text, length + 1, format, args);
+    va_end(args);
+    message->length = length;
+    enqueue_message(neighbour, message);
+}
+
+/*
+ * Queues a Deliver, Withdraw or Transfer to be sent to the neighbour. It
+ * is encoded by whichever thread writes it out.
+ */
+void send_task(Neighbour* neighbour, Task* task) {
+    OutMessage* message = new_out_message(0);
+    message->task = *task;
+    enqueue_message(neighbour, message);
+}
+
+/*
+ * Queues the 'Binary' line, after which everything sent to the neighbour
+ * is encoded as binary frames
+ */
+void switch_to_binary(Neighbour* neighbour) {
+    OutMessage* message = new_out_message(strlen("Binary\n"));
+    message->length = sprintf(message->text, "Binary\n");
+    message->task.type = BINARY;
+    enqueue_message(neighbour, message);
+}
+
+/*
+ * Queues the 'Caps' line listing what this depot supports. The neighbour
+ * counts everything sent after it against the credit it grants.
+ */
+void send_caps(Neighbour* neighbour) {
+    const char* caps = neighbour->depot->capsMessage;
+    OutMessage* message = new_out_message(strlen(caps));
+    message->length = sprintf(message->text, "%s", caps);
+    message->task.type = CAPS;
+    enqueue_message(neighbour, message);
+}
+
+/*
+ * Queues a message for the neighbour's writer without taking a lock or
+ * blocking. It is not sent until whatever the calling thread has logged
+ * is synced. Whoever the message is being handled for is held back if it
+ * has added to the queue while it is over OUT_QUEUE_LIMIT, and the
+ * connection is closed if the queue grows past OUT_QUEUE_CAP regardless.
+ */
+void enqueue_message(Neighbour* neighbour, OutMessage* message) {
+    OutQueue* out = &neighbour->out;
+    if (__atomic_load_n(&out->closed, __ATOMIC_ACQUIRE)) {
+        free(message);
+        return;
+    }
+    message->lsn = loggedLsn;
+    int queued = __atomic_add_fetch(&out->queued, 1, __ATOMIC_RELAXED);
+    message->next = __atomic_load_n(&out->stack, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&out->stack, &message->next, 
+            message, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+    if (queued > OUT_QUEUE_CAP) {
+        cut_off_neighbour(neighbour, queued);
+    }
+    wake_writer(neighbour);
+    update_backlog(neighbour);
+    if (dispatching && dispatching != neighbour && 
+            __atomic_load_n(&out->backlogged, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&dispatching->feeding, true, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Tells the neighbour's writer that there are messages to send, unless it
+ * has already been told and not yet looked
+ */
+void wake_writer(Neighbour* neighbour) {
+    if (__atomic_exchange_n(&neighbour->out.signalled, true, 
+            __ATOMIC_SEQ_CST)) {
+        return;
+    }
+    uint64_t wake = 1;
+    EventLoop* loop = neighbour->loop;
+    if (!loop) {
+        write(neighbour->out.wakeFd, &wake, sizeof(uint64_t));
+        return;
+    }
+    neighbour->nextDirty = __atomic_load_n(&loop->dirty, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&loop->dirty, 
+            &neighbour->nextDirty, neighbour, true, __ATOMIC_RELEASE, 
+            __ATOMIC_RELAXED)) {
+    }
+    write(loop->wakeFd, &wake, sizeof(uint64_t));
+}
+
+/*
+ * Closes the connection to a neighbour whose queue has grown past
+ * OUT_QUEUE_CAP, which holding back readers alone cannot prevent: a single
+ * Execute, the shard workers and route changes all add to it without
+ * reading anything more. Whatever reads from the neighbour then sees the
+ * connection close and tears it down.
+ */
+void cut_off_neighbour(Neighbour* neighbour, int queued) {
+    if (__atomic_exchange_n(&neighbour->out.closed, true, 
+            __ATOMIC_SEQ_CST)) {
+        return;
+    }
+    fprintf(stderr, "depot: closing connection to %s with %d messages "
+            "queued\n", name_text(neighbour->nameId), queued);
+    shutdown(neighbour->reader.fd, SHUT_RDWR);
+}
+
+/*
+ * Counts the neighbour's queue among the depot's backlogged queues once it
+ * reaches OUT_QUEUE_LIMIT, and stops counting it once it has drained to
+ * half that or closed, letting go of the readers held back meanwhile
+ */
+void update_backlog(Neighbour* neighbour) {
+    OutQueue* out = &neighbour->out;
+    Depot* depot = neighbour->depot;
+    int queued = __atomic_load_n(&out->queued, __ATOMIC_RELAXED);
+    bool closed = __atomic_load_n(&out->closed, __ATOMIC_SEQ_CST);
+    bool backlogged = __atomic_load_n(&out->backlogged, __ATOMIC_SEQ_CST);
+    if (!backlogged && !closed && queued >= OUT_QUEUE_LIMIT) {
+        if (__atomic_exchange_n(&out->backlogged, true, __ATOMIC_SEQ_CST)) {
+            return;
+        }
+        __atomic_add_fetch(&depot->backlogged, 1, __ATOMIC_SEQ_CST);
+        // A queue closed meanwhile may never be looked at again
+        if (!__atomic_load_n(&out->closed, __ATOMIC_SEQ_CST)) {
+            return;
+        }
+        backlogged = closed = true;
+    }
+    if (backlogged && (closed || queued <= OUT_QUEUE_LIMIT / 2) && 
+            __atomic_exchange_n(&out->backlogged, false, __ATOMIC_SEQ_CST)) {
+        __atomic_sub_fetch(&depot->backlogged, 1, __ATOMIC_SEQ_CST);
+        release_held_readers(depot);
+    }
+}
+
+/*
+ * Has every reader held back by the depot's backlog look again at whether
+ * it still is, and grants any credit held back meanwhile
+ */
+void release_held_readers(Depot* depot) {
+    rcu_read_lock();
+    NeighbourTable* table = read_neighbours(depot);
+    for (int i = 0; i < table->numNeighbours; i++) {
+        replenish_credit(table->neighbours[i]);
+    }
+    rcu_read_unlock();
+    pthread_mutex_lock(&depot->backlogLock);
+    pthread_cond_broadcast(&depot->backlogDrained);
+    pthread_mutex_unlock(&depot->backlogLock);
+    uint64_t wake = 1;
+    for (int i = 0; i < depot->numEventLoops; i++) {
+        write(depot->eventLoops[i].wakeFd, &wake, sizeof(uint64_t));
+    }
+}
+
+/*
+ * Whether reading from the neighbour is held back, as what it sent has
+ * added to another neighbour's queue while that was over OUT_QUEUE_LIMIT.
+ * It is let go once no queue but its own is. Its own queue never holds it
+ * back, or two depots each sending the other more than it reads could
+ * stop reading from each other for good. Only called by whatever reads
+ * from the neighbour.
+ */
+bool reader_held(Neighbour* neighbour) {
+    if (!neighbour->feeding) {
+        return false;
+    }
+    if (!backlogged_elsewhere(neighbour)) {
+        __atomic_store_n(&neighbour->feeding, false, __ATOMIC_RELAXED);
+        return false;
+    }
+    // A neighbour this depot grants credit is held back by granting it no
+    // more instead
+    return !neighbour->granting;
+}
+
+/*
+ * Whether the queue of any neighbour but this one is over OUT_QUEUE_LIMIT
+ */
+bool backlogged_elsewhere(Neighbour* neighbour) {
+    int backlogged = __atomic_load_n(&neighbour->depot->backlogged, 
+            __ATOMIC_SEQ_CST);
+    return backlogged > (__atomic_load_n(&neighbour->out.backlogged, 
+            __ATOMIC_SEQ_CST) ? 1 : 0);
+}
+
+/*
+ * Blocks a neighbour's own reader thread while reading from it is held
+ * back. Event loops stop watching the socket instead, as they must never
+ * block.
+ */
+void wait_for_backlog(Neighbour* neighbour) {
+    if (!reader_held(neighbour)) {
+        return;
+    }
+    Depot* depot = neighbour->depot;
+    pthread_mutex_lock(&depot->backlogLock);
+    while (reader_held(neighbour)) {
+        pthread_cond_wait(&depot->backlogDrained, &depot->backlogLock);
+    }
+    pthread_mutex_unlock(&depot->backlogLock);
+}
+
+/*
+ * Writer thread for a neighbour without an event loop. Sends its queued
+ * messages each time it is woken, after waiting out the coalescing window,
+ * and waiting for the log to sync whatever they follow from, until the
+ * connection closes.
+ */
+void* writer_thread(void* param) {
+    Neighbour* neighbour = (Neighbour*)param;
+    OutQueue* out = &neighbour->out;
+    int window = neighbour->depot->config.coalesceWindow;
+    struct timespec delay = {window / 1000000, (window % 1000000) * 1000};
+    uint64_t wakes;
+    while (read(out->wakeFd, &wakes, sizeof(uint64_t)) > 0 || 
+            errno == EINTR) {
+        if (__atomic_load_n(&out->closed, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        // Senders do not wake the writer again until signalled is cleared,
+        // so the burst builds up on the queue meanwhile
+        if (window > 0) {
+            nanosleep(&delay, NULL);
+        }
+        __atomic_store_n(&out->signalled, false, __ATOMIC_SEQ_CST);
+        uint64_t awaited;
+        do {
+            pthread_mutex_lock(&out->lock);
+            flush_out_queue(neighbour, 0);
+            awaited = out->awaitedLsn;
+            pthread_mutex_unlock(&out->lock);
+            update_backlog(neighbour);
+            // What is held back for the log goes out once it has synced
+            if (awaited) {
+                wait_for_sync(&neighbour->depot->wal, awaited);
+            }
+        } while (awaited && 
+                !__atomic_load_n(&out->closed, __ATOMIC_ACQUIRE));
+    }
+    release_rcu_reader();
+    release_thread_metrics();
+    pthread_exit(NULL);
+}
+
+/*
+ * Writes the queued messages to the neighbour, gathering many into each
+ * call. Returns false if the socket would block with messages still
+ * pending. Once the connection fails everything queued is dropped. Must be
+ * called while holding the queue's lock.
+ */
+bool flush_out_queue(Neighbour* neighbour, int flags) {
+    OutQueue* out = &neighbour->out;
+    if (out->inFlight) {
+        // An io_uring is already writing from the pending list
+        return false;
+    }
+    take_out_messages(out);
+    queue_credit_grant(out);
+    while (out->pending) {
+        if (__atomic_load_n(&out->closed, __ATOMIC_ACQUIRE)) {
+            discard_out_messages(out);
+            return true;
+        }
+        struct iovec iov[OUT_BATCH];
+        struct msghdr header;
+        memset(&header, 0, sizeof(struct msghdr));
+        header.msg_iov = iov;
+        header.msg_iovlen = gather_out_messages(out, iov, 
+                synced_lsn(neighbour->depot));
+        if (header.msg_iovlen == 0) {
+            // The rest waits for the neighbour to grant more credit or for
+            // the log to sync, either of which wakes the writer again,
+            // unless the sync has just finished
+            if (out->awaitedLsn && 
+                    out->awaitedLsn <= synced_lsn(neighbour->depot)) {
+                continue;
+            }
+            return true;
+        }
+        ssize_t sent = sendmsg(neighbour->reader.fd, &header, 
+                flags | MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return false;
+            }
+            __atomic_store_n(&out->closed, true, __ATOMIC_RELEASE);
+            continue;
+        }
+        release_out_messages(out, sent);
+        if (!out->pending) {
+            take_out_messages(out);
+        }
+    }
+    return true;
+}
+
+/*
+ * Points the iovecs at up to OUT_BATCH pending messages, starting with
+ * whatever is left of the first, and stopping at any the neighbour does
+ * not yet have the credit for or which waits on more of the log than the
+ * given synced lsn. Returns how many are used. Must be called while
+ * holding the queue's lock.
+ */
+int gather_out_messages(OutQueue* out, struct iovec* iov, uint64_t synced) {
+    int count = 0;
+    size_t offset = out->pendingSent;
+    OutMessage** link = &out->pending;
+    __atomic_store_n(&out->awaitedLsn, 0, __ATOMIC_SEQ_CST);
+    while (*link && count < OUT_BATCH) {
+        if ((*link)->lsn > synced) {
+            __atomic_store_n(&out->awaitedLsn, (*link)->lsn, 
+                    __ATOMIC_SEQ_CST);
+            break;
+        }
+        if (!(*link)->charged && !charge_out_message(out, link)) {
+            break;
+        }
+        OutMessage* message = *link;
+        iov[count].iov_base = message->text + offset;
+        iov[count].iov_len = message->length - offset;
+        offset = 0;
+        count++;
+        link = &message->next;
+    }
+    return count;
+}
+
+/*
+ * Charges the message at the link against the neighbour's credit, once
+ * this depot's 'Caps' has gone ahead of it. A message is never split, so
+ * the credit may be overdrawn. Once it is used up, if the neighbour limits
+ * what it is sent, a 'Credit' message further on is moved up to the link
+ * instead, so that two depots never each hold up the other's grants.
+ * Grants are charged like anything else, but never held back. Returns
+ * false if there is nothing which can be sent. Must be called while
+ * holding the queue's lock.
+ */
+bool charge_out_message(OutQueue* out, OutMessage** link) {
+    OutMessage* message = *link;
+    if (message->task.type != CREDIT && 
+            __atomic_load_n(&out->limited, __ATOMIC_ACQUIRE) && 
+            __atomic_load_n(&out->credit, __ATOMIC_RELAXED) <= 0) {
+        if (!out->grantsQueued) {
+            return false;
+        } else {
+            // A grant cannot move ahead of the switch to binary frames,
+            // as it was encoded for what follows
+            OutMessage* previous = message;
+            while (previous->next && previous->next->task.type != CREDIT &&
+                    previous->next->task.type != BINARY) {
+                previous = previous->next;
+            }
+            message = previous->next;
+            if (!message || message->task.type != CREDIT) {
+                return false;
+            }
+            previous->next = message->next;
+            if (out->pendingTail == message) {
+                out->pendingTail = previous;
+            }
+            message->next = *link;
+            *link = message;
+        }
+    }
+    if (out->counting) {
+        __atomic_sub_fetch(&out->credit, message->length, __ATOMIC_RELAXED);
+    }
+    out->counting |= message->task.type == CAPS;
+    if (message->task.type == CREDIT) {
+        out->grantsQueued--;
+    }
+    message->charged = true;
+    return true;
+}
+
+/*
+ * Queues a 'Credit' message for any credit granted to the neighbour since
+ * the last one. Must be called while holding the queue's lock, after
+ * taking the messages already sent, so that it is encoded like them.
+ */
+void queue_credit_grant(OutQueue* out) {
+    long long grant = __atomic_exchange_n(&out->grant, 0, __ATOMIC_ACQUIRE);
+    if (grant <= 0) {
+        return;
+    }
+    if (grant > INT_MAX) {
+        __atomic_add_fetch(&out->grant, grant - INT_MAX, __ATOMIC_RELAXED);
+        grant = INT_MAX;
+    }
+    int length = snprintf(NULL, 0, "Credit:%lld\n", grant);
+    OutMessage* message = new_out_message(length);
+    message->length = sprintf(message->text, "Credit:%lld\n", grant);
+    message->task.type = CREDIT;
+    if (out->binary) {
+        message = encode_text_frames(message);
+    }
+    message->next = NULL;
+    if (out->pendingTail) {
+        out->pendingTail->next = message;
+    } else {
+        out->pending = message;
+    }
+    out->pendingTail = message;
+    out->grantsQueued++;
+    __atomic_fetch_add(&out->queued, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Moves everything pushed onto the queue since it was last looked at to
+ * the end of the pending list, restoring the order it was sent in and
+ * encoding each message in that order
+ */
+void take_out_messages(OutQueue* out) {
+    OutMessage* message = __atomic_exchange_n(&out->stack, NULL, 
+            __ATOMIC_ACQUIRE);
+    if (!message) {
+        return;
+    }
+    OutMessage* reversed = NULL;
+    while (message) {
+        OutMessage* next = message->next;
+        message->next = reversed;
+        reversed = message;
+        message = next;
+    }
+    if (out->coalesce) {
+        reversed = coalesce_deliveries(out, reversed);
+    }
+    OutMessage** link = out->pendingTail ? &out->pendingTail->next : 
+            &out->pending;
+    for (message = reversed; message; message = reversed) {
+        reversed = message->next;
+        message = encode_out_message(out, message);
+        *link = message;
+        link = &message->next;
+        out->pendingTail = message;
+    }
+    *link = NULL;
+}
+
+/*
+ * Merges the deliveries in each unbroken run of queued deliveries into one
+ * per resource, kept where that resource first appears in the run, as
+ * long as the total fits in a message. Returns the shortened list.
+ */
+OutMessage* coalesce_deliveries(OutQueue* out, OutMessage* messages) {
+    uint64_t merged = 0;
+    OutMessage* runStart = NULL;
+    OutMessage** link = &messages;
+    while (1) {
+        OutMessage* message = *link;
+        if (!message || message->task.type != DELIVER) {
+            // The run is over, so forget what it kept
+            for (; runStart && runStart != message; 
+                    runStart = runStart->next) {
+                coalesceSlots[runStart->task.nameId] = NULL;
+            }
+            runStart = NULL;
+            if (!message) {
+                break;
+            }
+            link = &message->next;
+            continue;
+        }
+        int nameId = message->task.nameId;
+        if (nameId >= coalesceSlotsSize) {
+            int size = coalesceSlotsSize ? coalesceSlotsSize : 64;
+            while (size <= nameId) {
+                size *= 2;
+            }
+            coalesceSlots = (OutMessage**)realloc(coalesceSlots, 
+                    sizeof(OutMessage*) * size);
+            memset(coalesceSlots + coalesceSlotsSize, 0, 
+                    sizeof(OutMessage*) * (size - coalesceSlotsSize));
+            coalesceSlotsSize = size;
+        }
+        runStart = runStart ? runStart : message;
+        OutMessage* kept = coalesceSlots[nameId];
+        if (kept && kept->task.quantity <= INT_MAX - message->task.quantity) {
+            kept->task.quantity += message->task.quantity;
+            kept->lsn = message->lsn > kept->lsn ? message->lsn : kept->lsn;
+            *link = message->next;
+            free(message);
+            merged++;
+            continue;
+        }
+        coalesceSlots[nameId] = message;
+        link = &message->next;
+    }
+    if (merged) {
+        __atomic_fetch_sub(&out->queued, merged, __ATOMIC_RELAXED);
+        count(&thread_metrics()->coalesced, merged);
+    }
+    return messages;
+}
+
+/*
+ * Frees the pending messages covered by the given number of bytes just
+ * written, remembering how far into the next one the write got
+ */
+void release_out_messages(OutQueue* out, size_t sent) {
+    __atomic_store_n(&out->sent, out->sent + sent, __ATOMIC_RELAXED);
+    sent += out->pendingSent;
+    while (out->pending && sent >= out->pending->length) {
+        OutMessage* message = out->pending;
+        sent -= message->length;
+        out->pending = message->next;
+        free(message);
+        __atomic_fetch_sub(&out->queued, 1, __ATOMIC_RELAXED);
+    }
+    if (!out->pending) {
+        out->pendingTail = NULL;
+    }
+    out->pendingSent = sent;
+}
+
+/*
+ * Drops every message queued for a neighbour whose connection has failed
+ */
+void discard_out_messages(OutQueue* out) {
+    do {
+        while (out->pending) {
+            OutMessage* message = out->pending;
+            out->pending = message->next;
+            free(message);
+            __atomic_fetch_sub(&out->queued, 1, __ATOMIC_RELAXED);
+        }
+        out->pendingTail = NULL;
+        out->pendingSent = 0;
+        out->grantsQueued = 0;
+        take_out_messages(out);
+    } while (out->pending);
+}
+
+/*
+ * Creates an empty line reader for the given socket
+ */
+void init_line_reader(LineReader* reader, int fd) {
+    reader->fd = fd;
+    reader->capacity = LINE_BUFFER_SIZE;
+    reader->buffer = (char*)malloc(reader->capacity);
+    reader->start = 0;
+    reader->length = 0;
+    reader->eof = false;
+    reader->binary = false;
+    reader->wireNames = NULL;
+    reader->numWireNames = 0;
+    reader->wireNamesCapacity = 0;
+    reader->received = 0;
+}
+
+/*
+ * Returns the next whole line already in the buffer with its newline
+ * replaced by a terminator, or NULL if there is none. After the connection
+ * has closed any unterminated remainder is returned as the last line.
+ */
+char* take_line(LineReader* reader) {
+    char* line = reader->buffer + reader->start;
+    size_t available = reader->length - reader->start;
+    char* newline = (char*)memchr(line, '\n', available);
+    if (newline) {
+        *newline = '\0';
+        reader->start += newline - line + 1;
+        return line;
+    }
+    if (reader->eof && available > 0) {
+        // fill_line_reader always leaves a spare byte for this terminator
+        line[available] = '\0';
+        reader->start = reader->length;
+        return line;
+    }
+    return NULL;
+}
+
+/*
+ * Reads whatever is available from the connection into the buffer in one
+ * call, making room first by discarding consumed lines or growing. Returns
+ * the result of recv(2).
+ */
+ssize_t fill_line_reader(LineReader* reader, int flags) {
+    if (reader->start == reader->length) {
+        reader->start = 0;
+        reader->length = 0;
+    } else if (reader->length + 1 == reader->capacity) {
+        if (reader->start > 0) {
+            reader->length -= reader->start;
+            memmove(reader->buffer, reader->buffer + reader->start, 
+                    reader->length);
+            reader->start = 0;
+        } else {
+            reader->capacity *= 2;
+            reader->buffer = (char*)realloc(reader->buffer, 
+                    reader->capacity);
+        }
+    }
+    ssize_t got;
+    do {
+        got = recv(reader->fd, reader->buffer + reader->length, 
+                reader->capacity - reader->length - 1, flags);
+    } while (got < 0 && errno == EINTR);
+    if (got > 0) {
+        reader->length += got;
+        __atomic_store_n(&reader->received, reader->received + got, 
+                __ATOMIC_RELAXED);
+    } else if (got == 0) {
+        reader->eof = true;
+    }
+    return got;
+}
+
+/*
+ * Returns how many of the bytes received on the connection have been
+ * taken from the buffer. Only called by whatever reads from it.
+ */
+uint64_t handled_bytes(LineReader* reader) {
+    return reader->received - (reader->length - reader->start);
+}
+
+/*
+ * Encodes a message taken off a neighbour's queue in whichever protocol
+ * the neighbour is now being sent, returning the message to write, which
+ * may replace the one given. Must be called while holding the queue's
+ * lock, in the order the messages are written.
+ */
+OutMessage* encode_out_message(OutQueue* out, OutMessage* message) {
+    MessageType type = message->task.type;
+    bool task = type == DELIVER || type == WITHDRAW || type == TRANSFER;
+    if (!out->binary) {
+        // The 'Binary' line itself still goes out as text
+        out->binary = type == BINARY;
+        return task ? format_task(message) : message;
+    }
+    return task ? encode_task_frame(out, message) : 
+            encode_text_frames(message);
+}
+
+/*
+ * Formats a queued task as a text message
+ */
+OutMessage* format_task(OutMessage* message) {
+    Task* task = &message->task;
+    const char* dest = task->type == TRANSFER ? name_text(task->destId) : 
+            NULL;
+    int length = snprintf(NULL, 0, "%s:%d:%s%s%s\n", 
+            messageTypeNames[task->type], task->quantity, 
+            name_text(task->nameId), dest ? ":" : "", dest ? dest : "");
+    OutMessage* text = new_out_message(length);
+    text->length = sprintf(text->text, "%s:%d:%s%s%s\n", 
+            messageTypeNames[task->type], task->quantity, 
+            name_text(task->nameId), dest ? ":" : "", dest ? dest : "");
+    text->lsn = message->lsn;
+    free(message);
+    return text;
+}
+
+/*
+ * Encodes a queued task as a binary frame: its type, its quantity as a
+ * varint, then its names
+ */
+OutMessage* encode_task_frame(OutQueue* out, OutMessage* message) {
+    Task* task = &message->task;
+    size_t capacity = 4 * VARINT_MAX + 1 + strlen(name_text(task->nameId));
+    if (task->type == TRANSFER) {
+        capacity += VARINT_MAX + strlen(name_text(task->destId));
+    }
+    OutMessage* frame = new_out_message(capacity);
+    // The body goes after room for its length, which is then moved up
+    // against it
+    char* body = frame->text + VARINT_MAX;
+    size_t length = 0;
+    body[length++] = task->type;
+    length += encode_varint(body + length, task->quantity);
+    length += encode_wire_name(out, body + length, task->nameId);
+    if (task->type == TRANSFER) {
+        length += encode_wire_name(out, body + length, task->destId);
+    }
+    char prefix[VARINT_MAX];
+    size_t prefixLength = encode_varint(prefix, length);
+    memcpy(body - prefixLength, prefix, prefixLength);
+    memmove(frame->text, body - prefixLength, prefixLength + length);
+    frame->length = prefixLength + length;
+    frame->lsn = message->lsn;
+    free(message);
+    return frame;
+}
+
+/*
+ * Wraps each line of a queued text message in a binary frame of its own
+ */
+OutMessage* encode_text_frames(OutMessage* message) {
+    const char* line = message->text;
+    const char* end = message->text + message->length;
+    size_t numLines = 1;
+    for (const char* next = line; 
+            (next = (const char*)memchr(next, '\n', end - next)); next++) {
+        numLines++;
+    }
+    OutMessage* frames = new_out_message(message->length + 
+            (VARINT_MAX + 1) * numLines);
+    while (line < end) {
+        const char* newline = (const char*)memchr(line, '\n', end - line);
+        size_t length = (newline ? newline : end) - line;
+        frames->length += encode_varint(frames->text + frames->length, 
+                length + 1);
+        frames->text[frames->length++] = FRAME_TEXT;
+        memcpy(frames->text + frames->length, line, length);
+        frames->length += length;
+        line += length + 1;
+    }
+    frames->task.type = message->task.type;
+    frames->lsn = message->lsn;
+    free(message);
+    return frames;
+}
+
+/*
+ * Writes a name into a binary frame. A name already sent is written as
+ * its wire ID shifted up one place. Otherwise its length is written,
+ * shifted up two places, with the low bit set and the next bit set if it
+ * takes the next wire ID, followed by the name itself.
+ */
+size_t encode_wire_name(OutQueue* out, char* bytes, int nameId) {
+    if (nameId < out->wireIdsSize && out->wireIds[nameId]) {
+        return encode_varint(bytes, 
+                (uint64_t)(out->wireIds[nameId] - 1) << 1);
+    }
+    bool define = out->numWireIds < MAX_WIRE_NAMES;
+    if (define) {
+        if (nameId >= out->wireIdsSize) {
+            int size = out->wireIdsSize ? out->wireIdsSize : 64;
+            while (size <= nameId) {
+                size *= 2;
+            }
+            out->wireIds = (int*)realloc(out->wireIds, sizeof(int) * size);
+            memset(out->wireIds + out->wireIdsSize, 0, 
+                    sizeof(int) * (size - out->wireIdsSize));
+            out->wireIdsSize = size;
+        }
+        out->wireIds[nameId] = ++out->numWireIds;
+    }
+    const char* text = name_text(nameId);
+    size_t length = strlen(text);
+    size_t used = encode_varint(bytes, 
+            ((uint64_t)length << 2) | (define << 1) | 1);
+    memcpy(bytes + used, text, length);
+    return used + length;
+}
+
+/*
+ * Writes a number seven bits to a byte, lowest first, with the top bit set
+ * on every byte but the last. Returns the number of bytes written.
+ */
+size_t encode_varint(char* bytes, uint64_t value) {
+    size_t length = 0;
+    while (value >= 0x80) {
+        bytes[length++] = (char)(value | 0x80);
+        value >>= 7;
+    }
+    bytes[length++] = (char)value;
+    return length;
+}
+
+/*
+ * Takes the next whole binary frame from the buffer, a varint length
+ * followed by that many bytes, pointing frame at those bytes. Returns
+ * false if there is none yet. A frame which is empty, too long or cut
+ * short by the connection closing abandons the connection.
+ */
+bool take_frame(LineReader* reader, ByteReader* frame) {
+    ByteReader header = {reader->buffer + reader->start, 
+            reader->buffer + reader->length, false};
+    size_t available = reader->length - reader->start;
+    if (available == 0) {
+        return false;
+    }
+    uint64_t length = get_varint(&header);
+    if (!header.failed && length > 0 && length <= MAX_FRAME_LENGTH) {
+        if (length <= (size_t)(header.end - header.next)) {
+            frame->next = header.next;
+            frame->end = header.next + length;
+            frame->failed = false;
+            reader->start = frame->end - reader->buffer;
+            return true;
+        }
+        if (!reader->eof) {
+            return false;
+        }
+    } else if (header.failed && available < VARINT_MAX && !reader->eof) {
+        return false;
+    }
+    abandon_reader(reader);
+    return false;
+}
+
+/*
+ * Decodes the body of a binary frame holding a Deliver, Withdraw or
+ * Transfer. Returns false if the frame is malformed.
+ */
+bool decode_frame(LineReader* reader, uint8_t type, ByteReader* frame, 
+        Command* command) {
+    if (type != DELIVER && type != WITHDRAW && type != TRANSFER) {
+        return false;
+    }
+    command->type = type;
+    uint64_t quantity = get_varint(frame);
+    command->nameId = get_wire_name(reader, frame);
+    command->destId = type == TRANSFER ? get_wire_name(reader, frame) : -1;
+    if (frame->failed || frame->next != frame->end || quantity == 0 || 
+            quantity > INT_MAX) {
+        return false;
+    }
+    command->quantity = quantity;
+    command->name.start = name_text(command->nameId);
+    command->name.length = strlen(command->name.start);
+    if (type == TRANSFER) {
+        command->dest.start = name_text(command->destId);
+        command->dest.length = strlen(command->dest.start);
+    }
+    return true;
+}
+
+/*
+ * Reads a name written by encode_wire_name and returns its name ID,
+ * remembering the wire ID of a newly defined name. Returns -1 and fails
+ * the frame if the name is unknown or could not appear in a text message.
+ */
+int get_wire_name(LineReader* reader, ByteReader* frame) {
+    uint64_t value = get_varint(frame);
+    if (frame->failed) {
+        return -1;
+    }
+    if (!(value & 1)) {
+        if ((value >> 1) >= (uint64_t)reader->numWireNames) {
+            frame->failed = true;
+            return -1;
+        }
+        return reader->wireNames[value >> 1];
+    }
+    uint64_t length = value >> 2;
+    bool define = value & 2;
+    Field name = {frame->next, length};
+    if (length == 0 || length > (uint64_t)(frame->end - frame->next) || 
+            memchr(name.start, ':', length) || 
+            memchr(name.start, '\n', length) || 
+            memchr(name.start, '\0', length) || 
+            (define && reader->numWireNames == MAX_WIRE_NAMES)) {
+        frame->failed = true;
+        return -1;
+    }
+    frame->next += length;
+    int nameId = intern_name(name);
+    if (define) {
+        if (reader->numWireNames == reader->wireNamesCapacity) {
+            reader->wireNamesCapacity = reader->wireNamesCapacity * 2 + 64;
+            reader->wireNames = (int*)realloc(reader->wireNames, 
+                    sizeof(int) * reader->wireNamesCapacity);
+        }
+        reader->wireNames[reader->numWireNames++] = nameId;
+    }
+    return nameId;
+}
+
+/*
+ * Reads a number written by encode_varint
+ */
+uint64_t get_varint(ByteReader* reader) {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 7 * VARINT_MAX; shift += 7) {
+        uint8_t byte = get_u8(reader);
+        if (reader->failed) {
+            return 0;
+        }
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+    reader->failed = true;
+    return 0;
+}
+
+/*
+ * Gives up on a connection whose binary frames cannot be made sense of,
+ * as there is no telling where the next one starts. Reading then sees the
+ * connection close.
+ */
+void abandon_reader(LineReader* reader) {
+    reader->start = reader->length;
+    shutdown(reader->fd, SHUT_RDWR);
+}
+
+/*
+ * Adds the depot as described by the 'IM' message as a neighbour. Must be
+ * called while holding depotLock.
+ */
+void add_neighbour(Depot* depot, Neighbour* neighbour, Command* imCommand) {
+    Field port = imCommand->port;
+    neighbour->port = strndup(port.start, port.length);
+    neighbour->nameId = intern_name(imCommand->name);
+    NeighbourTable* old = depot->neighbourTable;
+    int numNeighbours = old->numNeighbours + 1;
+    Neighbour** neighbours = (Neighbour**)malloc(sizeof(Neighbour*) * 
+            numNeighbours);
+    memcpy(neighbours, old->neighbours, sizeof(Neighbour*) * 
+            old->numNeighbours);
+    neighbours[numNeighbours - 1] = neighbour;
+    publish_neighbours(depot, build_neighbour_table(neighbours, 
+            numNeighbours));
+    free(neighbours);
+}
+
+/*
+ * Removes a closed neighbour from the neighbour table. It is released
+ * along with the replaced table, once no reader can still be using that.
+ * Must be called while holding depotLock.
+ */
+void remove_neighbour(Depot* depot, Neighbour* neighbour) {
+    NeighbourTable* old = depot->neighbourTable;
+    Neighbour** neighbours = (Neighbour**)malloc(sizeof(Neighbour*) * 
+            (old->numNeighbours + 1));
+    int numNeighbours = 0;
+    for (int i = 0; i < old->numNeighbours; i++) {
+        if (old->neighbours[i] != neighbour) {
+            neighbours[numNeighbours++] = old->neighbours[i];
+        }
+    }
+    old->departed = neighbour;
+    publish_neighbours(depot, build_neighbour_table(neighbours, 
+            numNeighbours));
+    free(neighbours);
+}
+
+/*
+ * Creates a neighbour table holding the given neighbours, indexed by name
+ * and by port
+ */
+NeighbourTable* build_neighbour_table(Neighbour** neighbours, 
+        int numNeighbours) {
+    int indexSize = 4;
+    while (indexSize < numNeighbours * 2) {
+        indexSize *= 2;
+    }
+    NeighbourTable* table = (NeighbourTable*)calloc(1, 
+            sizeof(NeighbourTable) + sizeof(Neighbour*) * 
+            (numNeighbours + 2 * indexSize));
+    table->numNeighbours = numNeighbours;
+    table->indexSize = indexSize;
+    table->byName = table->neighbours + numNeighbours;
+    table->byPort = table->byName + indexSize;
+    int mask = indexSize - 1;
+    for (int i = 0; i < numNeighbours; i++) {
+        Neighbour* neighbour = neighbours[i];
+        table->neighbours[i] = neighbour;
+        int slot = hash_key(neighbour->nameId) & mask;
+        while (table->byName[slot]) {
+            slot = (slot + 1) & mask;
+        }
+        table->byName[slot] = neighbour;
+        Field port = {neighbour->port, strlen(neighbour->port)};
+        slot = hash_name(port) & mask;
+        while (table->byPort[slot]) {
+            slot = (slot + 1) & mask;
+        }
+        table->byPort[slot] = neighbour;
+    }
+    return table;
+}
+
+/*
+ * Replaces the published neighbour table, retiring the old one until no
+ * reader can still hold it, and tells the neighbours about any change in
+ * the routes through this depot. Must be called while holding depotLock.
+ */
+void publish_neighbours(Depot* depot, NeighbourTable* table) {
+    NeighbourTable* old = depot->neighbourTable;
+    compute_routes(depot, table);
+    __atomic_store_n(&depot->neighbourTable, table, __ATOMIC_SEQ_CST);
+    old->retiredEpoch = __atomic_add_fetch(&rcuEpoch, 1, __ATOMIC_SEQ_CST);
+    old->nextRetired = depot->retiredTables;
+    depot->retiredTables = old;
+    reclaim_tables(depot);
+    advertise_routes(depot, table);
+}
+
+/*
+ * Frees each retired table which every current reader started reading
+ * after it was replaced. Must be called while holding depotLock.
+ */
+void reclaim_tables(Depot* depot) {
+    uint64_t oldest = UINT64_MAX;
+    for (RcuReader* reader = __atomic_load_n(&rcuReaders, 
+            __ATOMIC_ACQUIRE); reader; reader = reader->next) {
+        uint64_t epoch = __atomic_load_n(&reader->epoch, __ATOMIC_SEQ_CST);
+        if (epoch != 0 && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+    NeighbourTable** link = &depot->retiredTables;
+    while (*link) {
+        NeighbourTable* table = *link;
+        if (table->retiredEpoch <= oldest) {
+            *link = table->nextRetired;
+            if (table->departed) {
+                release_neighbour(table->departed);
+            }
+            free(table->routes);
+            free(table);
+        } else {
+            link = &table->nextRetired;
+        }
+    }
+}
+
+/*
+ * Returns the published neighbour table. Must be called within a read
+ * section, and the table only used until it ends.
+ */
+NeighbourTable* read_neighbours(Depot* depot) {
+    return __atomic_load_n(&depot->neighbourTable, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Returns the next neighbour in the table with the given name, or NULL
+ * once there are no more. probe should start at zero.
+ */
+Neighbour* next_named(NeighbourTable* table, int nameId, int* probe) {
+    int mask = table->indexSize - 1;
+    int home = hash_key(nameId);
+    Neighbour* neighbour;
+    while ((neighbour = table->byName[(home + (*probe)++) & mask])) {
+        if (neighbour->nameId == nameId) {
+            return neighbour;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Returns a neighbour in the table on the given port, or NULL if there is
+ * none
+ */
+Neighbour* find_neighbour_port(NeighbourTable* table, Field port) {
+    int mask = table->indexSize - 1;
+    int slot = hash_name(port) & mask;
+    Neighbour* neighbour;
+    while ((neighbour = table->byPort[slot])) {
+        if (field_equals(port, neighbour->port)) {
+            return neighbour;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return NULL;
+}
+
+/*
+ * Returns the calling thread's reader entry, claiming one given up by an
+ * exited thread or registering a new one on first use
+ */
+RcuReader* rcu_reader(void) {
+    if (threadReader) {
+        return threadReader;
+    }
+    for (RcuReader* reader = __atomic_load_n(&rcuReaders, 
+            __ATOMIC_ACQUIRE); reader; reader = reader->next) {
+        bool claimed = false;
+        if (__atomic_compare_exchange_n(&reader->claimed, &claimed, true, 
+                false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            threadReader = reader;
+            return reader;
+        }
+    }
+    RcuReader* reader = (RcuReader*)calloc(1, sizeof(RcuReader));
+    reader->claimed = true;
+    reader->next = __atomic_load_n(&rcuReaders, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&rcuReaders, &reader->next, 
+            reader, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+    threadReader = reader;
+    return reader;
+}
+
+/*
+ * Gives up the calling thread's reader entry before it exits. Must be
+ * called outside any read section.
+ */
+void release_rcu_reader(void) {
+    if (threadReader) {
+        __atomic_store_n(&threadReader->claimed, false, __ATOMIC_RELEASE);
+        threadReader = NULL;
+    }
+}
+
+/*
+ * Starts a read section, within which no table read from
+ * read_neighbours will be freed. Sections may be nested.
+ */
+void rcu_read_lock(void) {
+    RcuReader* reader = rcu_reader();
+    if (reader->depth++ == 0) {
+        __atomic_store_n(&reader->epoch, __atomic_load_n(&rcuEpoch, 
+                __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+    }
+}
+
+/*
+ * Ends a read section begun with rcu_read_lock
+ */
+void rcu_read_unlock(void) {
+    RcuReader* reader = threadReader;
+    if (--reader->depth == 0) {
+        __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+ * Works out the shortest known route to every depot reachable through the
+ * table's neighbours, from each neighbour's last advertised distances.
+ * A neighbour is always reached directly. Must be called while holding
+ * depotLock.
+ */
+void compute_routes(Depot* depot, NeighbourTable* table) {
+    int numRoutes = 0;
+    for (int i = 0; i < table->numNeighbours; i++) {
+        Neighbour* neighbour = table->neighbours[i];
+        if (neighbour->nameId >= numRoutes) {
+            numRoutes = neighbour->nameId + 1;
+        }
+        for (int j = 0; j < neighbour->numAdvertised; j++) {
+            if (neighbour->advertised[j].nameId >= numRoutes) {
+                numRoutes = neighbour->advertised[j].nameId + 1;
+            }
+        }
+    }
+    Route* routes = (Route*)calloc(numRoutes + 1, sizeof(Route));
+    for (int i = 0; i < table->numNeighbours; i++) {
+        Neighbour* neighbour = table->neighbours[i];
+        if (!routes[neighbour->nameId].via) {
+            routes[neighbour->nameId] = (Route){neighbour, 1};
+        }
+    }
+    for (int i = 0; i < table->numNeighbours; i++) {
+        Neighbour* neighbour = table->neighbours[i];
+        for (int j = 0; j < neighbour->numAdvertised; j++) {
+            RouteEntry* entry = &neighbour->advertised[j];
+            int distance = entry->distance + 1;
+            Route* route = &routes[entry->nameId];
+            if (entry->nameId == depot->nameId || 
+                    distance >= ROUTE_INFINITY) {
+                continue;
+            }
+            if (!route->via || distance < route->distance) {
+                *route = (Route){neighbour, distance};
+            }
+        }
+    }
+    table->numRoutes = numRoutes;
+    table->routes = routes;
+}
+
+/*
+ * Sends each neighbour which understands routes the distances it can
+ * reach through this depot, if they have changed since it was last told.
+ * Must be called while holding depotLock.
+ */
+void advertise_routes(Depot* depot, NeighbourTable* table) {
+    for (int i = 0; i < table->numNeighbours; i++) {
+        Neighbour* neighbour = table->neighbours[i];
+        if (!(__atomic_load_n(&neighbour->caps, __ATOMIC_ACQUIRE) & 
+                CAP_ROUTE)) {
+            continue;
+        }
+        char* message = format_routes(depot, table, neighbour);
+        if (neighbour->routesSent && 
+                strcmp(neighbour->routesSent, message) == 0) {
+            free(message);
+            continue;
+        }
+        send_message(neighbour, "%s", message);
+        free(neighbour->routesSent);
+        neighbour->routesSent = message;
+    }
+}
+
+/*
+ * Returns the 'Route' message telling a neighbour how far this depot is
+ * from every depot it can reach, starting with itself. Routes which pass
+ * through the neighbour are left out so that it never routes back through
+ * this depot to reach them.
+ */
+char* format_routes(Depot* depot, NeighbourTable* table, Neighbour* to) {
+    size_t length = snprintf(NULL, 0, "Route:%s:0\n", depot->depotName);
+    for (int nameId = 0; nameId < table->numRoutes; nameId++) {
+        Route* route = &table->routes[nameId];
+        if (route->via && route->via != to) {
+            length += snprintf(NULL, 0, ":%s:%d", name_text(nameId), 
+                    route->distance);
+        }
+    }
+    char* message = (char*)malloc(length + 1);
+    size_t used = sprintf(message, "Route:%s:0", depot->depotName);
+    for (int nameId = 0; nameId < table->numRoutes; nameId++) {
+        Route* route = &table->routes[nameId];
+        if (route->via && route->via != to) {
+            used += sprintf(message + used, ":%s:%d", name_text(nameId), 
+                    route->distance);
+        }
+    }
+    strcpy(message + used, "\n");
+    return message;
+}
+
+/*
+ * Queues the delivery for a transfer to every neighbour with its
+ * destination's name. Returns whether there were any. Must be called
+ * within a read section.
+ */
+bool deliver_to(NeighbourTable* table, Task* transfer) {
+    int probe = 0;
+    Neighbour* neighbour;
+    Task delivery = {.type = DELIVER, .quantity = transfer->quantity, 
+            .nameId = transfer->nameId, .destId = -1};
+    bool delivered = false;
+    while ((neighbour = next_named(table, transfer->destId, &probe))) {
+        send_task(neighbour, &delivery);
+        delivered = true;
+    }
+    return delivered;
+}
+
+/*
+ * Passes a transfer's delivery on towards its destination along the
+ * shortest known route, allowing it at most the given number of hops.
+ * Returns false, dropping the delivery, if the destination cannot be
+ * reached in time. Must be called within a read section.
+ */
+bool forward_delivery(NeighbourTable* table, Task* transfer, int hops) {
+    if (transfer->destId >= table->numRoutes) {
+        return false;
+    }
+    Route* route = &table->routes[transfer->destId];
+    if (!route->via || route->distance > hops) {
+        return false;
+    }
+    send_message(route->via, "Forward:%d:%s:%s:%d\n", transfer->quantity, 
+            name_text(transfer->nameId), name_text(transfer->destId), 
+            hops - 1);
+    return true;
+}
+
+/*
+ * Records the distances a neighbour has advertised in a 'Route' message
+ * and republishes the neighbour table with the routes they give
+ */
+void handle_route_message(Depot* depot, Command* routeCommand) {
+    Neighbour* neighbour = routeCommand->source;
+    int numEntries = 0;
+    int capacity = 4;
+    RouteEntry* entries = (RouteEntry*)malloc(sizeof(RouteEntry) * 
+            capacity);
+    Field list = routeCommand->list;
+    Field name;
+    Field distance;
+    while (next_field(&list, &name) && next_field(&list, &distance)) {
+        unsigned long number;
+        parse_number(distance, &number);
+        if (numEntries == capacity) {
+            capacity *= 2;
+            entries = (RouteEntry*)realloc(entries, sizeof(RouteEntry) * 
+                    capacity);
+        }
+        entries[numEntries++] = (RouteEntry){intern_name(name), number};
+    }
+    free(neighbour->advertised);
+    neighbour->advertised = entries;
+    neighbour->numAdvertised = numEntries;
+    NeighbourTable* old = depot->neighbourTable;
+    publish_neighbours(depot, build_neighbour_table(old->neighbours, 
+            old->numNeighbours));
+}
+
+/*
+ * Handles a 'Forward' message, a transfer's delivery being passed on
+ * towards its destination. It is added here if this depot is the
+ * destination, and otherwise sent on with one less hop to spare.
+ */
+void handle_forward_message(Depot* depot, Command* forwardCommand) {
+    Task task = {.type = TRANSFER, .quantity = forwardCommand->quantity, 
+            .nameId = intern_name(forwardCommand->name), 
+            .destId = intern_name(forwardCommand->dest)};
+    if (task.destId == depot->nameId) {
+        task.type = DELIVER;
+        if (shard_task(depot, &task)) {
+            return;
+        }
+        begin_change(depot);
+        apply_task(depot, &task);
+        log_task(depot, &task);
+        end_change(depot);
+        return;
+    }
+    rcu_read_lock();
+    NeighbourTable* table = read_neighbours(depot);
+    if (!deliver_to(table, &task)) {
+        forward_delivery(table, &task, forwardCommand->hops);
+    }
+    rcu_read_unlock();
+}
+
+/*
+ * Check for whether or not a 'Route' message's list is made up of names
+ * each followed by a distance below ROUTE_INFINITY
+ */
+bool valid_routes(Field list) {
+    Field name;
+    Field distance;
+    unsigned long number;
+    int numEntries = 0;
+    while (next_field(&list, &name)) {
+        if (!next_field(&list, &distance) || 
+                !parse_number(distance, &number) || 
+                number >= ROUTE_INFINITY) {
+            return false;
+        }
+        numEntries++;
+    }
+    return numEntries > 0;
+}
+
+/*
+ * Adds the resource as described by the 'Deliver' message to the depots list
+ * of resources
+ */
+void add_resource(Depot* depot, Command* deliverCommand) {
+    Task task;
+    make_task(deliverCommand, &task);
+    if (shard_task(depot, &task)) {
+        return;
+    }
+    begin_change(depot);
+    apply_task(depot, &task);
+    log_task(depot, &task);
+    end_change(depot);
+}
+
+/*
+ * Withdraws the resource as described by the 'Withdraw' message from the
+ * depot
+ */
+void withdraw_resource(Depot* depot, Command* withdrawCommand) {
+    Task task;
+    make_task(withdrawCommand, &task);
+    if (shard_task(depot, &task)) {
+        return;
+    }
+    begin_change(depot);
+    apply_task(depot, &task);
+    log_task(depot, &task);
+    end_change(depot);
+}
+
+/*
+ * Converts a Deliver, Withdraw or Transfer message into a task, interning
+ * its names. Returns false for any other type of message.
+ */
+bool make_task(Command* command, Task* task) {
+    if (command->type != DELIVER && command->type != WITHDRAW && 
+            command->type != TRANSFER) {
+        return false;
+    }
+    task->type = command->type;
+    task->quantity = command->quantity;
+    task->nameId = command->nameId >= 0 ? command->nameId : 
+            intern_name(command->name);
+    task->destId = -1;
+    if (command->type == TRANSFER) {
+        task->destId = command->destId >= 0 ? command->destId : 
+                intern_name(command->dest);
+    }
+    return true;
+}
+
+/*
+ * Converts a Deliver, Withdraw, Transfer or Batch message into its tasks,
+ * interning their names. Returns the tasks, to be freed by the caller, or
+ * NULL for any other type of message.
+ */
+Task* make_tasks(Command* command, int* numTasks) {
+    if (command->type != BATCH) {
+        Task* task = (Task*)malloc(sizeof(Task));
+        if (!make_task(command, task)) {
+            free(task);
+            return NULL;
+        }
+        *numTasks = 1;
+        return task;
+    }
+    int capacity = 16;
+    Task* tasks = (Task*)malloc(sizeof(Task) * capacity);
+    *numTasks = 0;
+    Field list = command->list;
+    long quantity;
+    Field name;
+    while (next_batch_op(&list, &quantity, &name)) {
+        if (*numTasks == capacity) {
+            capacity *= 2;
+            tasks = (Task*)realloc(tasks, sizeof(Task) * capacity);
+        }
+        tasks[(*numTasks)++] = (Task){
+                .type = quantity > 0 ? DELIVER : WITHDRAW, 
+                .quantity = quantity > 0 ? quantity : -quantity, 
+                .nameId = intern_name(name), .destId = -1};
+    }
+    return tasks;
+}
+
+/*
+ * Applies a task to the depot's resources, sending the delivery for a
+ * transfer on
+ */
+void run_task(Depot* depot, Task* task) {
+    apply_task(depot, task);
+    if (task->type == TRANSFER) {
+        send_transfer(depot, task);
+    }
+}
+
+/*
+ * Queues the delivery for a transfer to every neighbour with its
+ * destination's name, or forwards it towards the destination if it is
+ * not a neighbour
+ */
+void send_transfer(Depot* depot, Task* task) {
+    rcu_read_lock();
+    NeighbourTable* table = read_neighbours(depot);
+    if (!deliver_to(table, task)) {
+        forward_delivery(table, task, ROUTE_INFINITY);
+    }
+    rcu_read_unlock();
+}
+
+/*
+ * Applies a task's change to the depot's resources only
+ */
+void apply_task(Depot* depot, Task* task) {
+    Resource* resource = get_resource(depot, task->nameId);
+    if (task->type == DELIVER) {
+        __atomic_fetch_add(&resource->quantity, task->quantity, 
+                __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_sub(&resource->quantity, task->quantity, 
+                __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Starts the shard workers requested by DEPOT_SHARDS. With none requested
+ * handlers apply every task themselves.
+ */
+void init_shards(Depot* depot) {
+    depot->numShards = 0;
+    if (depot->config.shards <= 0) {
+        return;
+    }
+    pthread_mutex_init(&depot->shardLock, NULL);
+    pthread_cond_init(&depot->shardApplied, NULL);
+    depot->pendingExecutes = 0;
+    // The workers start before the signal thread, so they block signals
+    // from the outset and leave them to it
+    sigset_t set;
+    sigset_t old;
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+    depot->shards = (Shard*)malloc(sizeof(Shard) * depot->config.shards);
+    for (int i = 0; i < depot->config.shards; i++) {
+        Shard* shard = &depot->shards[i];
+        shard->depot = depot;
+        shard->stack = NULL;
+        shard->signalled = false;
+        shard->wakeFd = eventfd(0, 0);
+        pthread_create(&shard->threadID, NULL, shard_worker, (void*)shard);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    depot->numShards = depot->config.shards;
+}
+
+/*
+ * Adds a Deliver, Withdraw or Transfer to the calling thread's batch for
+ * the shard owning its resource, handing the batch over once it is full.
+ * Returns false, leaving the caller to run the task, if there are no
+ * shards.
+ */
+bool shard_task(Depot* depot, Task* task) {
+    if (depot->numShards == 0) {
+        return false;
+    }
+    if (!shardBatches) {
+        shardBatches = (ShardBatch**)calloc(depot->numShards, 
+                sizeof(ShardBatch*));
+    }
+    int index = task->nameId % depot->numShards;
+    ShardBatch* batch = shardBatches[index];
+    if (!batch) {
+        batch = (ShardBatch*)malloc(sizeof(ShardBatch));
+        batch->change = NULL;
+        batch->numTasks = 0;
+        shardBatches[index] = batch;
+    }
+    batch->tasks[batch->numTasks++] = *task;
+    if (batch->numTasks == SHARD_BATCH) {
+        push_shard_batch(&depot->shards[index], batch);
+        shardBatches[index] = NULL;
+    }
+    return true;
+}
+
+/*
+ * Hands a batch of tasks to a shard's worker, waking it unless it has
+ * already been told and not yet looked
+ */
+void push_shard_batch(Shard* shard, ShardBatch* batch) {
+    batch->next = __atomic_load_n(&shard->stack, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&shard->stack, &batch->next, 
+            batch, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+    if (!__atomic_exchange_n(&shard->signalled, true, __ATOMIC_SEQ_CST)) {
+        uint64_t wake = 1;
+        write(shard->wakeFd, &wake, sizeof(uint64_t));
+    }
+}
+
+/*
+ * Hands every batch the calling thread has started to its shard's worker
+ */
+void flush_shard_batches(Depot* depot) {
+    if (!shardBatches) {
+        return;
+    }
+    for (int i = 0; i < depot->numShards; i++) {
+        if (shardBatches[i]) {
+            push_shard_batch(&depot->shards[i], shardBatches[i]);
+            shardBatches[i] = NULL;
+            hold_back_feeder(depot);
+        }
+    }
+}
+
+/*
+ * Marks the neighbour being dispatched, if any, as feeding the backlog
+ * once it has handed the shards something. What a shard sends on cannot
+ * be traced back to whoever handed it over, so they are held back as if
+ * they sent it.
+ */
+void hold_back_feeder(Depot* depot) {
+    if (dispatching && 
+            __atomic_load_n(&depot->backlogged, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&dispatching->feeding, true, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Frees the calling thread's table of batches before it exits, once they
+ * have been flushed
+ */
+void release_shard_batches(void) {
+    free(shardBatches);
+    shardBatches = NULL;
+}
+
+/*
+ * Hands a Batch's tasks to the shards owning them, to be applied and
+ * logged as one and then freed. Returns false, leaving the caller to apply
+ * them, if there are no shards.
+ */
+bool shard_tasks(Depot* depot, Task* tasks, int numTasks) {
+    if (depot->numShards == 0) {
+        return false;
+    }
+    ShardChange* change = (ShardChange*)calloc(1, sizeof(ShardChange));
+    change->tasks = tasks;
+    change->numTasks = numTasks;
+    submit_shard_change(depot, change, false);
+    return true;
+}
+
+/*
+ * Hands the tasks claimed by an Execute, just logged by the calling
+ * thread, to the shards owning them to be run as one and counts them as
+ * pending until they have been. Must be called while holding depotLock.
+ * Returns false, leaving the caller to run them, if there are no shards.
+ */
+bool shard_deferred(Depot* depot, TaskChunk* chunk) {
+    if (depot->numShards == 0) {
+        return false;
+    }
+    ShardChange* change = (ShardChange*)calloc(1, sizeof(ShardChange));
+    change->chunk = chunk;
+    change->lsn = loggedLsn;
+    submit_shard_change(depot, change, false);
+    return true;
+}
+
+/*
+ * Waits until the shards have run every Execute handed to them, whose
+ * tasks are in neither the deferred tasks nor the resources until then.
+ * Must be called while holding depotLock, so no more are handed over.
+ */
+void wait_for_executes(Depot* depot) {
+    if (depot->numShards == 0) {
+        return;
+    }
+    pthread_mutex_lock(&depot->shardLock);
+    while (depot->pendingExecutes > 0) {
+        pthread_cond_wait(&depot->shardApplied, &depot->shardLock);
+    }
+    pthread_mutex_unlock(&depot->shardLock);
+}
+
+/*
+ * Waits until every shard has applied everything the calling thread has
+ * handed it
+ */
+void drain_shards(Depot* depot) {
+    if (depot->numShards == 0) {
+        return;
+    }
+    submit_shard_change(depot, 
+            (ShardChange*)calloc(1, sizeof(ShardChange)), true);
+}
+
+/*
+ * Queues a change to every shard owning one of its resources, or to all of
+ * them if it has none, behind whatever the calling thread has already
+ * handed them. With wait set this returns once the change is applied.
+ */
+void submit_shard_change(Depot* depot, ShardChange* change, bool wait) {
+    bool* involved = (bool*)calloc(depot->numShards, sizeof(bool));
+    int numInvolved = 0;
+    for (int i = 0; i < change->numTasks; i++) {
+        involved[change->tasks[i].nameId % depot->numShards] = true;
+    }
+    for (TaskChunk* chunk = change->chunk; chunk; chunk = chunk->next) {
+        for (int i = 0; i < chunk->numTasks; i++) {
+            involved[chunk->tasks[i].nameId % depot->numShards] = true;
+        }
+    }
+    for (int i = 0; i < depot->numShards; i++) {
+        numInvolved += involved[i];
+    }
+    if (numInvolved == 0) {
+        memset(involved, true, depot->numShards);
+        numInvolved = depot->numShards;
+    }
+    change->arriving = numInvolved;
+    change->holders = numInvolved + wait;
+    change->applied = false;
+
+    flush_shard_batches(depot);
+    pthread_mutex_lock(&depot->shardLock);
+    depot->pendingExecutes += change->chunk != NULL;
+    for (int i = 0; i < depot->numShards; i++) {
+        if (involved[i]) {
+            ShardBatch* batch = (ShardBatch*)malloc(
+                    offsetof(ShardBatch, tasks));
+            batch->change = change;
+            batch->numTasks = 0;
+            push_shard_batch(&depot->shards[i], batch);
+        }
+    }
+    pthread_mutex_unlock(&depot->shardLock);
+    hold_back_feeder(depot);
+    free(involved);
+
+    if (wait) {
+        pthread_mutex_lock(&depot->shardLock);
+        while (!change->applied) {
+            pthread_cond_wait(&depot->shardApplied, &depot->shardLock);
+        }
+        pthread_mutex_unlock(&depot->shardLock);
+        release_shard_change(change);
+    }
+}
+
+/*
+ * Called by each shard's worker on reaching a change. The last to reach it
+ * applies it, while the others wait until it has.
+ */
+void reach_shard_change(Depot* depot, ShardChange* change) {
+    if (__atomic_sub_fetch(&change->arriving, 1, __ATOMIC_ACQ_REL) > 0) {
+        pthread_mutex_lock(&depot->shardLock);
+        while (!change->applied) {
+            pthread_cond_wait(&depot->shardApplied, &depot->shardLock);
+        }
+        pthread_mutex_unlock(&depot->shardLock);
+        release_shard_change(change);
+        return;
+    }
+    bool execute = change->chunk != NULL;
+    if (execute) {
+        // What the tasks send must wait for the Execute to be synced
+        if (loggedLsn < change->lsn) {
+            loggedLsn = change->lsn;
+        }
+        apply_deferred(depot, change->chunk);
+    } else if (change->numTasks > 0) {
+        begin_change(depot);
+        for (int i = 0; i < change->numTasks; i++) {
+            apply_task(depot, &change->tasks[i]);
+        }
+        log_batch(depot, change->tasks, change->numTasks);
+        end_change(depot);
+    }
+    pthread_mutex_lock(&depot->shardLock);
+    change->applied = true;
+    depot->pendingExecutes -= execute;
+    pthread_cond_broadcast(&depot->shardApplied);
+    pthread_mutex_unlock(&depot->shardLock);
+    release_shard_change(change);
+}
+
+/*
+ * Lets go of a change, freeing it once nothing else holds it
+ */
+void release_shard_change(ShardChange* change) {
+    if (__atomic_sub_fetch(&change->holders, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(change->tasks);
+        free(change);
+    }
+}
+
+/*
+ * Shard worker which, each time it is woken, takes every batch queued for
+ * it and runs them in the order they were queued
+ */
+void* shard_worker(void* param) {
+    Shard* shard = (Shard*)param;
+    uint64_t wakes;
+    while (read(shard->wakeFd, &wakes, sizeof(uint64_t)) > 0 || 
+            errno == EINTR) {
+        // Handlers do not wake the worker again until signalled is
+        // cleared, so anything queued after this is taken next time
+        __atomic_store_n(&shard->signalled, false, __ATOMIC_SEQ_CST);
+        ShardBatch* batch = __atomic_exchange_n(&shard->stack, NULL, 
+                __ATOMIC_ACQUIRE);
+        ShardBatch* ordered = NULL;
+        while (batch) {
+            ShardBatch* next = batch->next;
+            batch->next = ordered;
+            ordered = batch;
+            batch = next;
+        }
+        run_shard_batches(shard, ordered);
+    }
+    return 0;
+}
+
+/*
+ * Runs and frees a list of batches, each run of them between shared
+ * changes as a single change, logging each batch as one record so the log
+ * is locked once a batch instead of once a task. Nothing is held while
+ * waiting at a shared change, so a snapshot is not held up by it.
+ */
+void run_shard_batches(Shard* shard, ShardBatch* batches) {
+    Depot* depot = shard->depot;
+    while (batches) {
+        ShardBatch* next = batches->next;
+        if (batches->change) {
+            reach_shard_change(depot, batches->change);
+            free(batches);
+            batches = next;
+            continue;
+        }
+        begin_change(depot);
+        while (batches && !batches->change) {
+            next = batches->next;
+            log_batch(depot, batches->tasks, batches->numTasks);
+            for (int i = 0; i < batches->numTasks; i++) {
+                run_task(depot, &batches->tasks[i]);
+            }
+            free(batches);
+            batches = next;
+        }
+        end_change(depot);
+    }
+}
+
+/*
+ * Restores the depot's resources and deferred tasks from DEPOT_DATA_DIR,
+ * loading the latest snapshot and replaying every log written since, then
+ * starts a new log generation. Returns whether any earlier state was
+ * found.
+ */
+bool recover_state(Depot* depot) {
+    WriteAheadLog* wal = &depot->wal;
+    wal->enabled = false;
+    wal->fd = -1;
+    if (!depot->config.dataDir) {
+        return false;
+    }
+    mkdir(depot->config.dataDir, 0777);
+    unsigned generation = 1;
+    bool recovered = load_snapshot(depot, &generation);
+    unsigned* generations;
+    int numGenerations = list_wals(depot, &generations);
+    unsigned next = generation;
+    for (int i = 0; i < numGenerations; i++) {
+        if (generations[i] >= generation) {
+            replay_wal(depot, generations[i]);
+            next = generations[i] + 1;
+        }
+        recovered = true;
+    }
+    free(generations);
+    // The shards must have applied everything replayed before they start
+    // logging what they apply
+    drain_shards(depot);
+
+    pthread_mutex_init(&wal->lock, NULL);
+    pthread_cond_init(&wal->changed, NULL);
+    memset(&wal->buffer, 0, sizeof(ByteBuffer));
+    memset(&wal->spare, 0, sizeof(ByteBuffer));
+    wal->writing = false;
+    wal->sinceSnapshot = 0;
+    wal->appended = 0;
+    wal->synced = 0;
+    wal->fd = open_wal(depot, next);
+    wal->generation = next;
+    wal->nextFd = -1;
+    wal->enabled = wal->fd >= 0;
+    return recovered;
+}
+
+/*
+ * Starts the threads which write out the log and take snapshots. Changes
+ * logged before this are held in the log's buffer.
+ */
+void start_persistence(Depot* depot) {
+    WriteAheadLog* wal = &depot->wal;
+    if (!wal->enabled) {
+        return;
+    }
+    pthread_create(&wal->threadID, NULL, wal_thread, (void*)depot);
+    if (depot->config.snapshotInterval > 0) {
+        pthread_create(&wal->snapshotThreadID, NULL, snapshot_thread, 
+                (void*)depot);
+    }
+}
+
+/*
+ * Marks the start of a change to the depot's persisted state, keeping any
+ * snapshot from being taken until the change has been applied and logged
+ */
+void begin_change(Depot* depot) {
+    if (depot->wal.enabled) {
+        pthread_rwlock_rdlock(&persistLock);
+    }
+}
+
+/*
+ * Marks the end of a change begun with begin_change
+ */
+void end_change(Depot* depot) {
+    if (depot->wal.enabled) {
+        pthread_rwlock_unlock(&persistLock);
+    }
+}
+
+/*
+ * Logs the change a task made to the depot's resources
+ */
+void log_task(Depot* depot, Task* task) {
+    WriteAheadLog* wal = &depot->wal;
+    if (!wal->enabled) {
+        return;
+    }
+    long long delta = task->type == DELIVER ? task->quantity : 
+            -(long long)task->quantity;
+    size_t start = begin_record(wal, RECORD_DELTA);
+    put_u64(&wal->buffer, (uint64_t)delta);
+    put_name(&wal->buffer, name_text(task->nameId));
+    end_record(wal, start);
+}
+
+/*
+ * Logs tasks being deferred under the given key
+ */
+void log_defer(Depot* depot, unsigned key, Task* tasks, int numTasks) {
+    WriteAheadLog* wal = &depot->wal;
+    if (!wal->enabled) {
+        return;
+    }
+    size_t start = begin_record(wal, RECORD_DEFER);
+    put_u32(&wal->buffer, key);
+    put_u32(&wal->buffer, numTasks);
+    for (int i = 0; i < numTasks; i++) {
+        put_task(&wal->buffer, &tasks[i]);
+    }
+    end_record(wal, start);
+}
+
+/*
+ * Logs the changes made by a batch as a single record, so a crash cannot
+ * leave it half applied
+ */
+void log_batch(Depot* depot, Task* tasks, int numTasks) {
+    WriteAheadLog* wal = &depot->wal;
+    if (!wal->enabled) {
+        return;
+    }
+    size_t start = begin_record(wal, RECORD_BATCH);
+    put_u32(&wal->buffer, numTasks);
+    for (int i = 0; i < numTasks; i++) {
+        put_task(&wal->buffer, &tasks[i]);
+    }
+    end_record(wal, start);
+}
+
+/*
+ * Logs the tasks deferred under the given key being executed
+ */
+void log_execute(Depot* depot, unsigned key) {
+    WriteAheadLog* wal = &depot->wal;
+    if (!wal->enabled) {
+        return;
+    }
+    size_t start = begin_record(wal, RECORD_EXECUTE);
+    put_u32(&wal->buffer, key);
+    end_record(wal, start);
+}
+
+/*
+ * Starts a record in the log's buffer, leaving room for its header.
+ * Returns where the record starts, with the log's lock held until
+ * end_record.
+ */
+size_t begin_record(WriteAheadLog* wal, RecordType type) {
+    pthread_mutex_lock(&wal->lock);
+    size_t start = wal->buffer.length;
+    put_u32(&wal->buffer, 0);
+    put_u32(&wal->buffer, 0);
+    put_u8(&wal->buffer, type);
+    return start;
+}
+
+/*
+ * Fills in the length and checksum of the record begun at start and hands
+ * it to the log thread
+ */
+void end_record(WriteAheadLog* wal, size_t start) {
+    char* body = wal->buffer.data + start + 2 * sizeof(uint32_t);
+    uint32_t length = wal->buffer.data + wal->buffer.length - body;
+    uint32_t sum = checksum(body, length);
+    memcpy(wal->buffer.data + start, &length, sizeof(uint32_t));
+    memcpy(wal->buffer.data + start + sizeof(uint32_t), &sum, 
+            sizeof(uint32_t));
+    wal->sinceSnapshot += wal->buffer.length - start;
+    wal->appended += wal->buffer.length - start;
+    loggedLsn = wal->appended;
+    pthread_cond_broadcast(&wal->changed);
+    pthread_mutex_unlock(&wal->lock);
+}
+
+/*
+ * Log thread which writes out and syncs everything logged since it last
+ * looked, so changes made during a sync share the next one, then lets go
+ * of the messages waiting for it
+ */
+void* wal_thread(void* param) {
+    Depot* depot = (Depot*)param;
+    WriteAheadLog* wal = &depot->wal;
+    pthread_mutex_lock(&wal->lock);
+    while (1) {
+        while (wal->buffer.length == 0) {
+            pthread_cond_wait(&wal->changed, &wal->lock);
+        }
+        ByteBuffer full = wal->buffer;
+        wal->buffer = wal->spare;
+        wal->spare = full;
+        wal->writing = true;
+        int fd = wal->fd;
+        int nextFd = wal->nextFd;
+        uint64_t end = wal->appended;
+        size_t head = full.length;
+        if (nextFd >= 0) {
+            head = wal->rotateAt - (end - full.length);
+            wal->nextFd = -1;
+        }
+        pthread_mutex_unlock(&wal->lock);
+
+        // What was logged before a snapshot rotated the log finishes the
+        // old file, which is synced before anything goes in the new one
+        if (!write_all(fd, full.data, head) || fdatasync(fd) < 0) {
+            perror("depot: write-ahead log");
+        }
+        if (nextFd >= 0) {
+            close(fd);
+            fd = nextFd;
+            if (!write_all(fd, full.data + head, full.length - head) || 
+                    fdatasync(fd) < 0) {
+                perror("depot: write-ahead log");
+            }
+        }
+
+        pthread_mutex_lock(&wal->lock);
+        wal->fd = fd;
+        wal->spare.length = 0;
+        wal->writing = false;
+        __atomic_store_n(&wal->synced, end, __ATOMIC_SEQ_CST);
+        pthread_cond_broadcast(&wal->changed);
+        pthread_mutex_unlock(&wal->lock);
+        wake_synced(depot, end);
+        pthread_mutex_lock(&wal->lock);
+    }
+    return 0;
+}
+
+/*
+ * Blocks until the log has been synced up to the given lsn
+ */
+void wait_for_sync(WriteAheadLog* wal, uint64_t lsn) {
+    pthread_mutex_lock(&wal->lock);
+    while (wal->synced < lsn) {
+        pthread_cond_wait(&wal->changed, &wal->lock);
+    }
+    pthread_mutex_unlock(&wal->lock);
+}
+
+/*
+ * Wakes each neighbour on an event loop whose messages were held back for
+ * the log, now that it has synced up to the given lsn. Writer threads wait
+ * on the log themselves.
+ */
+void wake_synced(Depot* depot, uint64_t synced) {
+    if (depot->numEventLoops == 0) {
+        return;
+    }
+    rcu_read_lock();
+    NeighbourTable* table = read_neighbours(depot);
+    for (int i = 0; i < table->numNeighbours; i++) {
+        Neighbour* neighbour = table->neighbours[i];
+        uint64_t awaited = __atomic_load_n(&neighbour->out.awaitedLsn, 
+                __ATOMIC_SEQ_CST);
+        if (neighbour->loop && awaited && awaited <= synced) {
+            wake_writer(neighbour);
+        }
+    }
+    rcu_read_unlock();
+}
+
+/*
+ * How much of the log is known to be synced. Anything may call it.
+ */
+uint64_t synced_lsn(Depot* depot) {
+    return __atomic_load_n(&depot->wal.synced, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Opens the log file for the given generation to append to, returning its
+ * descriptor or -1
+ */
+int open_wal(Depot* depot, unsigned generation) {
+    char* path = data_path(depot, "wal.%u", generation);
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0666);
+    if (fd < 0) {
+        perror(path);
+    } else {
+        sync_data_dir(depot);
+    }
+    free(path);
+    return fd;
+}
+
+/*
+ * Starts the next log generation in the given file from whatever is logged
+ * after this, leaving the log thread to finish the current file and switch
+ * over. Must be called while holding persistLock for writing.
+ */
+void rotate_wal(Depot* depot, int fd) {
+    WriteAheadLog* wal = &depot->wal;
+    pthread_mutex_lock(&wal->lock);
+    wal->nextFd = fd;
+    wal->rotateAt = wal->appended;
+    wal->generation++;
+    wal->sinceSnapshot = 0;
+    pthread_mutex_unlock(&wal->lock);
+}
+
+/*
+ * Snapshot thread which compacts the log every DEPOT_SNAPSHOT_MS, unless
+ * nothing has changed since the last snapshot
+ */
+void* snapshot_thread(void* param) {
+    Depot* depot = (Depot*)param;
+    int interval = depot->config.snapshotInterval;
+    struct timespec delay = {interval / 1000, (interval % 1000) * 1000000};
+    while (1) {
+        nanosleep(&delay, NULL);
+        pthread_mutex_lock(&depot->wal.lock);
+        bool changed = depot->wal.sinceSnapshot > 0;
+        pthread_mutex_unlock(&depot->wal.lock);
+        if (changed) {
+            take_snapshot(depot);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Writes a snapshot of the depot's state and starts a new log generation,
+ * then removes the logs the snapshot makes redundant. The state is copied
+ * while changes are held off; the slow part happens after.
+ */
+void take_snapshot(Depot* depot) {
+    WriteAheadLog* wal = &depot->wal;
+    pthread_mutex_lock(&wal->lock);
+    while (wal->nextFd >= 0) {
+        pthread_cond_wait(&wal->changed, &wal->lock);
+    }
+    unsigned generation = wal->generation + 1;
+    pthread_mutex_unlock(&wal->lock);
+    // The next log is opened before anything is locked and switched to by
+    // the log thread, so changes only wait while the state is copied
+    int walFd = open_wal(depot, generation);
+    if (walFd < 0) {
+        return;
+    }
+    ByteBuffer buffer = {NULL, 0, 0};
+    lock_depot();
+    wait_for_executes(depot);
+    pthread_rwlock_wrlock(&persistLock);
+    rotate_wal(depot, walFd);
+    encode_snapshot(depot, &buffer);
+    pthread_rwlock_unlock(&persistLock);
+    pthread_mutex_unlock(&depotLock);
+
+    char* temp = data_path(depot, "snapshot.tmp", 0);
+    char* path = data_path(depot, "snapshot", 0);
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd >= 0 && write_all(fd, buffer.data, buffer.length) && 
+            fsync(fd) == 0 && rename(temp, path) == 0) {
+        sync_data_dir(depot);
+        remove_wals(depot, generation);
+    } else {
+        perror("depot: snapshot");
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(temp);
+    free(path);
+    free(buffer.data);
+}
+
+/*
+ * Encodes the depot's resources and deferred tasks, along with the first
+ * log generation they do not cover, followed by a checksum of the whole
+ */
+void encode_snapshot(Depot* depot, ByteBuffer* buffer) {
+    put_bytes(buffer, SNAPSHOT_MAGIC, strlen(SNAPSHOT_MAGIC));
+    put_u32(buffer, depot->wal.generation);
+
+    size_t countAt = buffer->length;
+    uint64_t numResources = 0;
+    put_u64(buffer, 0);
+    int numNames = __atomic_load_n(&names.numNames, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < numNames; i++) {
+        Resource* resource = find_resource(depot, i);
+        if (resource && resource->quantity != 0) {
+            put_u64(buffer, (uint64_t)resource->quantity);
+            put_name(buffer, name_text(i));
+            numResources++;
+        }
+    }
+    memcpy(buffer->data + countAt, &numResources, sizeof(uint64_t));
+
+    put_u32(buffer, depot->numDeferredTasks);
+    for (int i = 0; i < depot->deferredTableSize; i++) {
+        DeferredTask* deferred = &depot->deferredTasks[i];
+        if (deferred->numTasks == 0) {
+            continue;
+        }
+        put_u32(buffer, deferred->key);
+        put_u32(buffer, deferred->numTasks);
+        for (TaskChunk* chunk = deferred->firstChunk; chunk; 
+                chunk = chunk->next) {
+            for (int j = 0; j < chunk->numTasks; j++) {
+                put_task(buffer, &chunk->tasks[j]);
+            }
+        }
+    }
+    put_u32(buffer, checksum(buffer->data, buffer->length));
+}
+
+/*
+ * Loads the snapshot in the data directory, if there is a valid one,
+ * storing the first log generation it does not cover. Returns whether a
+ * snapshot was loaded.
+ */
+bool load_snapshot(Depot* depot, unsigned* generation) {
+    char* path = data_path(depot, "snapshot", 0);
+    int fd = open(path, O_RDONLY);
+    free(path);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) < 0 || info.st_size < 
+            (off_t)(strlen(SNAPSHOT_MAGIC) + sizeof(uint32_t))) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    size_t size = info.st_size;
+    char* data = (char*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+    uint32_t sum;
+    memcpy(&sum, data + size - sizeof(uint32_t), sizeof(uint32_t));
+    if (memcmp(data, SNAPSHOT_MAGIC, strlen(SNAPSHOT_MAGIC)) != 0 || 
+            checksum(data, size - sizeof(uint32_t)) != sum) {
+        fprintf(stderr, "depot: ignoring damaged snapshot\n");
+        munmap(data, size);
+        return false;
+    }
+
+    ByteReader reader = {data + strlen(SNAPSHOT_MAGIC), 
+            data + size - sizeof(uint32_t), false};
+    *generation = get_u32(&reader);
+    uint64_t numResources = get_u64(&reader);
+    for (uint64_t i = 0; i < numResources && !reader.failed; i++) {
+        long long quantity = (long long)get_u64(&reader);
+        int nameId = get_name(&reader);
+        // Nothing has been handed to the shards yet, so this cannot race
+        // their workers
+        if (nameId >= 0) {
+            get_resource(depot, nameId)->quantity = quantity;
+        }
+    }
+    uint32_t numKeys = get_u32(&reader);
+    for (uint32_t i = 0; i < numKeys && !reader.failed; i++) {
+        DeferredTask* deferred = get_deferred(depot, get_u32(&reader));
+        uint32_t numTasks = get_u32(&reader);
+        Task task;
+        for (uint32_t j = 0; j < numTasks && get_task(&reader, &task); 
+                j++) {
+            append_task(deferred, &task);
+        }
+    }
+    munmap(data, size);
+    return true;
+}
+
+/*
+ * Replays every whole record in the log file for the given generation. A
+ * record cut short by a crash ends the replay.
+ */
+void replay_wal(Depot* depot, unsigned generation) {
+    char* path = data_path(depot, "wal.%u", generation);
+    int fd = open(path, O_RDONLY);
+    free(path);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) < 0 || info.st_size == 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    size_t size = info.st_size;
+    char* data = (char*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+    ByteReader reader = {data, data + size, false};
+    while (reader.next < reader.end) {
+        uint32_t length = get_u32(&reader);
+        uint32_t sum = get_u32(&reader);
+        if (reader.failed || length > (size_t)(reader.end - reader.next) || 
+                checksum(reader.next, length) != sum) {
+            break;
+        }
+        ByteReader record = {reader.next, reader.next + length, false};
+        replay_record(depot, &record);
+        reader.next += length;
+    }
+    munmap(data, size);
+}
+
+/*
+ * Applies a single log record to the depot without logging it again.
+ * Returns whether the record was understood.
+ */
+bool replay_record(Depot* depot, ByteReader* reader) {
+    RecordType type = get_u8(reader);
+    if (type == RECORD_DELTA) {
+        long long delta = (long long)get_u64(reader);
+        int nameId = get_name(reader);
+        if (nameId < 0 || delta > INT_MAX || delta < -INT_MAX) {
+            return false;
+        }
+        Task task = {.type = delta < 0 ? WITHDRAW : DELIVER, 
+                .quantity = delta < 0 ? -delta : delta, .nameId = nameId, 
+                .destId = -1};
+        replay_task(depot, &task);
+        return true;
+    }
+    if (type == RECORD_DEFER || type == RECORD_BATCH) {
+        DeferredTask* deferred = type == RECORD_DEFER ? 
+                get_deferred(depot, get_u32(reader)) : NULL;
+        uint32_t numTasks = get_u32(reader);
+        Task task;
+        for (uint32_t i = 0; i < numTasks; i++) {
+            if (!get_task(reader, &task)) {
+                return false;
+            }
+            if (deferred) {
+                append_task(deferred, &task);
+            } else {
+                replay_task(depot, &task);
+            }
+        }
+        return true;
+    }
+    if (type == RECORD_EXECUTE) {
+        TaskChunk* chunk = take_deferred(depot, get_u32(reader));
+        while (chunk) {
+            for (int i = 0; i < chunk->numTasks; i++) {
+                replay_task(depot, &chunk->tasks[i]);
+            }
+            TaskChunk* next = chunk->next;
+            free(chunk);
+            chunk = next;
+        }
+        return !reader->failed;
+    }
+    return false;
+}
+
+/*
+ * Applies a replayed task to its resource, on the shard owning it if there
+ * are any. Deliveries made by transfers were sent before the crash, so a
+ * transfer is only withdrawn.
+ */
+void replay_task(Depot* depot, Task* task) {
+    Task replayed = *task;
+    if (replayed.type == TRANSFER) {
+        replayed.type = WITHDRAW;
+    }
+    if (!shard_task(depot, &replayed)) {
+        apply_task(depot, &replayed);
+    }
+}
+
+/*
+ * Finds the generation of every log file in the data directory, in
+ * increasing order. Returns how many there are.
+ */
+int list_wals(Depot* depot, unsigned** generations) {
+    int numGenerations = 0;
+    int capacity = 0;
+    *generations = NULL;
+    DIR* dir = opendir(depot->config.dataDir);
+    if (!dir) {
+        return 0;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir))) {
+        unsigned generation;
+        int used = 0;
+        if (sscanf(entry->d_name, "wal.%u%n", &generation, &used) != 1 || 
+                entry->d_name[used] != '\0') {
+            continue;
+        }
+        if (numGenerations == capacity) {
+            capacity = capacity * 2 + 1;
+            *generations = (unsigned*)realloc(*generations, 
+                    sizeof(unsigned) * capacity);
+        }
+        (*generations)[numGenerations++] = generation;
+    }
+    closedir(dir);
+    qsort(*generations, numGenerations, sizeof(unsigned), 
+            comp_generations);
+    return numGenerations;
+}
+
+/*
+ * Removes the log files older than the given generation
+ */
+void remove_wals(Depot* depot, unsigned before) {
+    unsigned* generations;
+    int numGenerations = list_wals(depot, &generations);
+    for (int i = 0; i < numGenerations && generations[i] < before; i++) {
+        char* path = data_path(depot, "wal.%u", generations[i]);
+        unlink(path);
+        free(path);
+    }
+    free(generations);
+}
+
+/*
+ * Returns the path of a file in the data directory, its name formatted
+ * with the given generation
+ */
+char* data_path(Depot* depot, const char* name, unsigned generation) {
+    int nameLength = snprintf(NULL, 0, name, generation);
+    int length = strlen(depot->config.dataDir) + 1 + nameLength;
+    char* path = (char*)malloc(length + 1);
+    int dirLength = sprintf(path, "%s/", depot->config.dataDir);
+    snprintf(path + dirLength, nameLength + 1, name, generation);
+    return path;
+}
+
+/*
+ * Syncs the data directory so that files created or renamed in it survive
+ * a crash
+ */
+void sync_data_dir(Depot* depot) {
+    int fd = open(depot->config.dataDir, O_RDONLY | O_DIRECTORY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+/*
+ * Appends raw bytes to a buffer, growing it as needed
+ */
+void put_bytes(ByteBuffer* buffer, const void* bytes, size_t length) {
+    if (buffer->length + length > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity : 
+                WAL_BUFFER_SIZE;
+        while (buffer->length + length > capacity) {
+            capacity *= 2;
+        }
+        buffer->data = (char*)realloc(buffer->data, capacity);
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->length, bytes, length);
+    buffer->length += length;
+}
+
+/*
+ * Appends a single byte to a buffer
+ */
+void put_u8(ByteBuffer* buffer, uint8_t value) {
+    put_bytes(buffer, &value, sizeof(uint8_t));
+}
+
+/*
+ * Appends a 32 bit number to a buffer
+ */
+void put_u32(ByteBuffer* buffer, uint32_t value) {
+    put_bytes(buffer, &value, sizeof(uint32_t));
+}
+
+/*
+ * Appends a 64 bit number to a buffer
+ */
+void put_u64(ByteBuffer* buffer, uint64_t value) {
+    put_bytes(buffer, &value, sizeof(uint64_t));
+}
+
+/*
+ * Appends a name to a buffer, preceded by its length
+ */
+void put_name(ByteBuffer* buffer, const char* name) {
+    uint32_t length = strlen(name);
+    put_u32(buffer, length);
+    put_bytes(buffer, name, length);
+}
+
+/*
+ * Appends a task to a buffer, with its names written out in full
+ */
+void put_task(ByteBuffer* buffer, Task* task) {
+    put_u8(buffer, task->type);
+    put_u32(buffer, task->quantity);
+    put_name(buffer, name_text(task->nameId));
+    put_name(buffer, task->destId >= 0 ? name_text(task->destId) : "");
+}
+
+/*
+ * Reads raw bytes from a reader, or zeroes if there are too few left
+ */
+void get_bytes(ByteReader* reader, void* bytes, size_t length) {
+    if (reader->failed || (size_t)(reader->end - reader->next) < length) {
+        reader->failed = true;
+        memset(bytes, 0, length);
+        return;
+    }
+    memcpy(bytes, reader->next, length);
+    reader->next += length;
+}
+
+/*
+ * Reads a single byte from a reader
+ */
+uint8_t get_u8(ByteReader* reader) {
+    uint8_t value;
+    get_bytes(reader, &value, sizeof(uint8_t));
+    return value;
+}
+
+/*
+ * Reads a 32 bit number from a reader
+ */
+uint32_t get_u32(ByteReader* reader) {
+    uint32_t value;
+    get_bytes(reader, &value, sizeof(uint32_t));
+    return value;
+}
+
+/*
+ * Reads a 64 bit number from a reader
+ */
+uint64_t get_u64(ByteReader* reader) {
+    uint64_t value;
+    get_bytes(reader, &value, sizeof(uint64_t));
+    return value;
+}
+
+/*
+ * Reads a name from a reader and interns it. Returns its ID, or -1 if the
+ * name is empty or cut short.
+ */
+int get_name(ByteReader* reader) {
+    uint32_t length = get_u32(reader);
+    if (reader->failed || length == 0 || 
+            length > (size_t)(reader->end - reader->next)) {
+        reader->failed = true;
+        return -1;
+    }
+    Field name = {reader->next, length};
+    reader->next += length;
+    return intern_name(name);
+}
+
+/*
+ * Reads a task from a reader. Returns false if it is cut short or not a
+ * type of task.
+ */
+bool get_task(ByteReader* reader, Task* task) {
+    task->type = get_u8(reader);
+    task->quantity = get_u32(reader);
+    task->nameId = get_name(reader);
+    if (task->type == TRANSFER) {
+        task->destId = get_name(reader);
+    } else {
+        task->destId = -1;
+        reader->failed = reader->failed || get_u32(reader) != 0;
+    }
+    return !reader->failed && (task->type == DELIVER || 
+            task->type == WITHDRAW || task->type == TRANSFER);
+}
+
+/*
+ * Checksum used to spot damaged records and snapshots
+ */
+uint32_t checksum(const char* bytes, size_t length) {
+    Field field = {bytes, length};
+    unsigned long hash = hash_name(field);
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+/*
+ * Writes the whole of the given bytes to a file, retrying after short
+ * writes. Returns false on error.
+ */
+bool write_all(int fd, const char* bytes, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, bytes, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        bytes += written;
+        length -= written;
+    }
+    return true;
+}
+
+/*
+ * Creates an empty resource table
+ */
+void init_resources(Depot* depot) {
+    memset(depot->resourceChunks, 0, sizeof(depot->resourceChunks));
+}
+
+/*
+ * Returns the resource for the given name ID. Only the first use of a
+ * chunk of the table takes a lock.
+ */
+Resource* get_resource(Depot* depot, int nameId) {
+    Resource* resource = find_resource(depot, nameId);
+    if (resource) {
+        return resource;
+    }
+    int offset;
+    int chunk = locate_chunk(nameId, &offset);
+    pthread_mutex_lock(&resourceLock);
+    // Another thread may have added the chunk since we looked
+    if (!depot->resourceChunks[chunk]) {
+        int chunkSize = TABLE_CHUNK_SIZE << chunk;
+        Resource* resources = (Resource*)malloc(sizeof(Resource) * 
+                chunkSize);
+        for (int i = 0; i < chunkSize; i++) {
+            resources[i] = (Resource){.quantity = 0, 
+                    .nameId = nameId - offset + i};
+        }
+        __atomic_store_n(&depot->resourceChunks[chunk], resources, 
+                __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&resourceLock);
+    return &depot->resourceChunks[chunk][offset];
+}
+
+/*
+ * Returns the resource for the given name ID, or NULL if its chunk of the
+ * table has not been created yet. Safe to call without holding any lock.
+ */
+Resource* find_resource(Depot* depot, int nameId) {
+    int offset;
+    int chunk = locate_chunk(nameId, &offset);
+    Resource* resources = __atomic_load_n(&depot->resourceChunks[chunk], 
+            __ATOMIC_ACQUIRE);
+    return resources ? &resources[offset] : NULL;
+}
+
+/*
+ * Creates the empty name table
+ */
+void init_names(void) {
+    int indexSize = TABLE_CHUNK_SIZE * 2;
+    names.index = (NameIndex*)calloc(1, sizeof(NameIndex) + 
+            sizeof(int) * indexSize);
+    names.index->size = indexSize;
+}
+
+/*
+ * Returns the ID of the given name, adding it to the name table if it has
+ * not been seen before. Only adding a name takes a lock.
+ */
+int intern_name(Field name) {
+    unsigned long hash = hash_name(name);
+    int nameId = find_name(name, hash);
+    if (nameId >= 0) {
+        return nameId;
+    }
+    pthread_mutex_lock(&nameLock);
+    // Another thread may have added it since we looked
+    if ((nameId = find_name(name, hash)) < 0) {
+        nameId = insert_name(name, hash);
+    }
+    pthread_mutex_unlock(&nameLock);
+    return nameId;
+}
+
+/*
+ * Returns the ID of the given name, whose hash has already been worked
+ * out, or -1 if it has not been interned. Safe to call without holding
+ * any lock.
+ */
+int find_name(Field name, unsigned long hash) {
+    NameIndex* index = __atomic_load_n(&names.index, __ATOMIC_ACQUIRE);
+    int mask = index->size - 1;
+    int slot = hash & mask;
+    int nameId;
+    while ((nameId = __atomic_load_n(&index->slots[slot], 
+            __ATOMIC_ACQUIRE)) != 0) {
+        Name* entry = name_at(nameId - 1);
+        if (entry->hash == hash && field_equals(name, entry->text)) {
+            return nameId - 1;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return -1;
+}
+
+/*
+ * Returns the text of an interned name
+ */
+const char* name_text(int nameId) {
+    return name_at(nameId)->text;
+}
+
+/*
+ * Returns the entry for an interned name
+ */
+Name* name_at(int nameId) {
+    int offset;
+    int chunk = locate_chunk(nameId, &offset);
+    return &names.chunks[chunk][offset];
+}
+
+/*
+ * Adds a name to the table and returns its ID. Must be called while
+ * holding nameLock.
+ */
+int insert_name(Field name, unsigned long hash) {
+    if (names.numNames == names.capacity) {
+        int chunkSize = TABLE_CHUNK_SIZE << names.numChunks;
+        names.chunks[names.numChunks++] = (Name*)malloc(sizeof(Name) * 
+                chunkSize);
+        names.capacity += chunkSize;
+    }
+    if ((names.numNames + 1) * 2 > names.index->size) {
+        grow_name_index();
+    }
+    int nameId = names.numNames;
+    Name* entry = name_at(nameId);
+    *entry = (Name){.text = strndup(name.start, name.length), .hash = hash};
+    index_name(names.index, entry, nameId);
+    __atomic_store_n(&names.numNames, nameId + 1, __ATOMIC_RELEASE);
+    return nameId;
+}
+
+/*
+ * Grows the name index ahead of time so the given number of new names
+ * can be added without it being rebuilt
+ */
+void reserve_names(int count) {
+    pthread_mutex_lock(&nameLock);
+    while ((names.numNames + count) * 2 > names.index->size) {
+        grow_name_index();
+    }
+    pthread_mutex_unlock(&nameLock);
+}
+
+/*
+ * Publishes the name with the given ID in the index
+ */
+void index_name(NameIndex* index, Name* name, int nameId) {
+    int mask = index->size - 1;
+    int slot = name->hash & mask;
+    while (index->slots[slot] != 0) {
+        slot = (slot + 1) & mask;
+    }
+    __atomic_store_n(&index->slots[slot], nameId + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Replaces the name index with one twice the size. Threads may still be
+ * probing the old index, so it is kept on a retired list rather than
+ * freed. Must be called while holding nameLock.
+ */
+void grow_name_index(void) {
+    NameIndex* old = names.index;
+    int size = old->size * 2;
+    NameIndex* index = (NameIndex*)calloc(1, sizeof(NameIndex) + 
+            sizeof(int) * size);
+    index->size = size;
+    index->retired = old;
+    for (int i = 0; i < names.numNames; i++) {
+        index_name(index, name_at(i), i);
+    }
+    __atomic_store_n(&names.index, index, __ATOMIC_RELEASE);
+}
+
+/*
+ * FNV-1a hash of a name
+ */
+unsigned long hash_name(Field name) {
+    unsigned long hash = 14695981039346656037UL;
+    for (size_t i = 0; i < name.length; i++) {
+        hash ^= (unsigned char)name.start[i];
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+/*
+ * Finds which chunk of a chunked table holds the given position, storing
+ * the position within that chunk in offset
+ */
+int locate_chunk(int position, int* offset) {
+    unsigned scaled = position / TABLE_CHUNK_SIZE + 1;
+    int chunk = 31 - __builtin_clz(scaled);
+    *offset = position - TABLE_CHUNK_SIZE * ((1 << chunk) - 1);
+    return chunk;
+}
+
+/*
+ * Handles deferred messages by adding the task, or each task in a batch,
+ * to a list of pending tasks
+ */
+void handle_defer_message(Depot* depot, Command* deferCommand) {
+    // Tasks which could never run are dropped now rather than at Execute,
+    // before their key takes a slot in the table
+    Command command;
+    Task* tasks;
+    int numTasks;
+    if (!parse_message(deferCommand->task.start, &command) || 
+            !(tasks = make_tasks(&command, &numTasks))) {
+        return;
+    }
+    DeferredTask* deferred = get_deferred(depot, deferCommand->key);
+    begin_change(depot);
+    for (int i = 0; i < numTasks; i++) {
+        append_task(deferred, &tasks[i]);
+    }
+    log_defer(depot, deferCommand->key, tasks, numTasks);
+    end_change(depot);
+    free(tasks);
+}
+
+/*
+ * Executes the deferred task as described by the 'Execute' message, then
+ * releases everything that was held for its key. depotLock is only held
+ * while the key's tasks are claimed, so Executes for different keys run
+ * side by side.
+ */
+void handle_execute(Depot* depot, Command* executeCommand) {
+    lock_depot();
+    TaskChunk* chunk = take_deferred(depot, executeCommand->key);
+    if (!chunk) {
+        pthread_mutex_unlock(&depotLock);
+        return;
+    }
+    // The one record stands for every task run, so a crash cannot leave
+    // the key half executed. It is logged before depotLock is released so
+    // that a later Defer for the same key is logged after it. Tasks handed
+    // to the shards are counted before then, so no snapshot is taken until
+    // they have been run.
+    begin_change(depot);
+    log_execute(depot, executeCommand->key);
+    if (shard_deferred(depot, chunk)) {
+        end_change(depot);
+        pthread_mutex_unlock(&depotLock);
+        return;
+    }
+    pthread_mutex_unlock(&depotLock);
+    apply_deferred(depot, chunk);
+    end_change(depot);
+}
+
+/*
+ * Applies every task claimed from a key as one batch and frees them. The
+ * changes are summed per resource first, so each resource is updated once
+ * however many tasks touch it. The deliveries for any transfers are then
+ * queued.
+ */
+void apply_deferred(Depot* depot, TaskChunk* chunk) {
+    int numTouched = 0;
+    int touchedCapacity = 64;
+    int* touched = (int*)malloc(sizeof(int) * touchedCapacity);
+    for (TaskChunk* next = chunk; next; next = next->next) {
+        for (int i = 0; i < next->numTasks; i++) {
+            Task* task = &next->tasks[i];
+            if (task->nameId >= deferredDeltasSize) {
+                grow_deferred_deltas(task->nameId);
+            }
+            if (!deferredTouched[task->nameId]) {
+                if (numTouched == touchedCapacity) {
+                    touchedCapacity *= 2;
+                    touched = (int*)realloc(touched, 
+                            sizeof(int) * touchedCapacity);
+                }
+                touched[numTouched++] = task->nameId;
+                deferredTouched[task->nameId] = true;
+            }
+            deferredDeltas[task->nameId] += task->type == DELIVER ? 
+                    task->quantity : -(long long)task->quantity;
+        }
+    }
+    for (int i = 0; i < numTouched; i++) {
+        int nameId = touched[i];
+        if (deferredDeltas[nameId] != 0) {
+            __atomic_fetch_add(&get_resource(depot, nameId)->quantity, 
+                    deferredDeltas[nameId], __ATOMIC_RELAXED);
+        }
+        deferredDeltas[nameId] = 0;
+        deferredTouched[nameId] = false;
+    }
+    free(touched);
+    rcu_read_lock();
+    while (chunk) {
+        for (int i = 0; i < chunk->numTasks; i++) {
+            if (chunk->tasks[i].type == TRANSFER) {
+                send_transfer(depot, &chunk->tasks[i]);
+            }
+        }
+        TaskChunk* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    rcu_read_unlock();
+}
+
+/*
+ * Makes room in the calling thread's per-resource sums for the given name
+ * ID
+ */
+void grow_deferred_deltas(int nameId) {
+    int size = deferredDeltasSize ? deferredDeltasSize : 64;
+    while (size <= nameId) {
+        size *= 2;
+    }
+    deferredDeltas = (long long*)realloc(deferredDeltas, 
+            sizeof(long long) * size);
+    deferredTouched = (bool*)realloc(deferredTouched, sizeof(bool) * size);
+    memset(deferredDeltas + deferredDeltasSize, 0, 
+            sizeof(long long) * (size - deferredDeltasSize));
+    memset(deferredTouched + deferredDeltasSize, 0, 
+            sizeof(bool) * (size - deferredDeltasSize));
+    deferredDeltasSize = size;
+}
+
+/*
+ * Creates an empty deferred task table
+ */
+void init_deferred(Depot* depot) {
+    depot->numDeferredTasks = 0;
+    depot->deferredTableSize = DEFERRED_TABLE_SIZE;
+    depot->deferredTasks = (DeferredTask*)calloc(depot->deferredTableSize, 
+            sizeof(DeferredTask));
+}
+
+/*
+ * Returns the tasks deferred under the given key, or NULL if there are none
+ */
+DeferredTask* find_deferred(Depot* depot, unsigned key) {
+    unsigned mask = depot->deferredTableSize - 1;
+    for (unsigned slot = hash_key(key) & mask; 
+            depot->deferredTasks[slot].numTasks != 0; 
+            slot = (slot + 1) & mask) {
+        if (depot->deferredTasks[slot].key == key) {
+            return &depot->deferredTasks[slot];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Returns the tasks deferred under the given key, adding an empty entry
+ * for the key if there are none yet
+ */
+DeferredTask* get_deferred(Depot* depot, unsigned key) {
+    DeferredTask* deferred = find_deferred(depot, key);
+    if (deferred) {
+        return deferred;
+    }
+    if ((depot->numDeferredTasks + 1) * 2 > depot->deferredTableSize) {
+        grow_deferred(depot);
+    }
+    unsigned mask = depot->deferredTableSize - 1;
+    unsigned slot = hash_key(key) & mask;
+    while (depot->deferredTasks[slot].numTasks != 0) {
+        slot = (slot + 1) & mask;
+    }
+    depot->numDeferredTasks++;
+    deferred = &depot->deferredTasks[slot];
+    *deferred = (DeferredTask){.key = key, .numTasks = 0, 
+            .firstChunk = NULL, .lastChunk = NULL};
+    return deferred;
+}
+
+/*
+ * Doubles the size of the deferred task table
+ */
+void grow_deferred(Depot* depot) {
+    DeferredTask* old = depot->deferredTasks;
+    int oldSize = depot->deferredTableSize;
+    depot->deferredTableSize *= 2;
+    depot->deferredTasks = (DeferredTask*)calloc(depot->deferredTableSize, 
+            sizeof(DeferredTask));
+    unsigned mask = depot->deferredTableSize - 1;
+    for (int i = 0; i < oldSize; i++) {
+        if (old[i].numTasks == 0) {
+            continue;
+        }
+        unsigned slot = hash_key(old[i].key) & mask;
+        while (depot->deferredTasks[slot].numTasks != 0) {
+            slot = (slot + 1) & mask;
+        }
+        depot->deferredTasks[slot] = old[i];
+    }
+    free(old);
+}
+
+/*
+ * Empties the given slot of the deferred task table, moving back any
+ * entries after it which would otherwise no longer be found. The entry's
+ * chunks are left for the caller to free.
+ */
+void remove_deferred(Depot* depot, DeferredTask* deferred) {
+    unsigned mask = depot->deferredTableSize - 1;
+    unsigned hole = deferred - depot->deferredTasks;
+    unsigned slot = hole;
+    depot->deferredTasks[hole].numTasks = 0;
+    depot->numDeferredTasks--;
+    while (depot->deferredTasks[slot = (slot + 1) & mask].numTasks != 0) {
+        unsigned home = hash_key(depot->deferredTasks[slot].key) & mask;
+        // Only move entries whose home slot is not between the hole and
+        // where they currently are
+        if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+            depot->deferredTasks[hole] = depot->deferredTasks[slot];
+            depot->deferredTasks[slot].numTasks = 0;
+            hole = slot;
+        }
+    }
+}
+
+/*
+ * Removes the tasks deferred under the given key from the table, returning
+ * their chunks for the caller to run and free, or NULL if there are none
+ */
+TaskChunk* take_deferred(Depot* depot, unsigned key) {
+    DeferredTask* deferred = find_deferred(depot, key);
+    if (!deferred) {
+        return NULL;
+    }
+    TaskChunk* chunk = deferred->firstChunk;
+    remove_deferred(depot, deferred);
+    return chunk;
+}
+
+/*
+ * Adds a task to the end of the key's chunks, starting a new chunk twice
+ * the size of the last when it is full
+ */
+void append_task(DeferredTask* deferred, Task* task) {
+    TaskChunk* chunk = deferred->lastChunk;
+    if (!chunk || chunk->numTasks == chunk->capacity) {
+        int capacity = chunk ? chunk->capacity * 2 : TASK_CHUNK_MIN;
+        if (capacity > TASK_CHUNK_MAX) {
+            capacity = TASK_CHUNK_MAX;
+        }
+        TaskChunk* next = (TaskChunk*)malloc(sizeof(TaskChunk) + 
+                sizeof(Task) * capacity);
+        *next = (TaskChunk){.next = NULL, .numTasks = 0, 
+                .capacity = capacity};
+        if (chunk) {
+            chunk->next = next;
+        } else {
+            deferred->firstChunk = next;
+        }
+        deferred->lastChunk = chunk = next;
+    }
+    chunk->tasks[chunk->numTasks++] = *task;
+    deferred->numTasks++;
+}
+
+/*
+ * Spreads a deferred task key across the table
+ */
+unsigned hash_key(unsigned key) {
+    key ^= key >> 16;
+    key *= 0x85ebca6bu;
+    key ^= key >> 13;
+    key *= 0xc2b2ae35u;
+    return key ^ (key >> 16);
+}
+
+/*
+ * Handles incoming connect messages by connecting to the given depot
+ */
+void handle_connect_message(Depot* depot, Command* connectCommand) {
+    if (has_neighbour_port(depot, connectCommand->port)) {
+        return;
+    }
+    request_connect(depot, connectCommand->port);
+}
+
+/*
+ * Transfer goods from the current depot to the depot as described by
+ * the 'Transfer' message
+ */
+void handle_transfer_message(Depot* depot, Command* transferCommand) {
+    Task task;
+    make_task(transferCommand, &task);
+    if (shard_task(depot, &task)) {
+        return;
+    }
+    // Logged first, so that the delivery waits for the record to sync
+    begin_change(depot);
+    log_task(depot, &task);
+    run_task(depot, &task);
+    end_change(depot);
+}
+
+/*
+ * Applies every delivery and withdrawal in a 'Batch' message as a single
+ * change
+ */
+void handle_batch_message(Depot* depot, Command* batchCommand) {
+    int numTasks;
+    Task* tasks = make_tasks(batchCommand, &numTasks);
+    if (shard_tasks(depot, tasks, numTasks)) {
+        return;
+    }
+    begin_change(depot);
+    for (int i = 0; i < numTasks; i++) {
+        apply_task(depot, &tasks[i]);
+    }
+    log_batch(depot, tasks, numTasks);
+    end_change(depot);
+    free(tasks);
+}
+
+/*
+ * Records the capabilities a neighbour has advertised in a 'Caps'
+ * message, answering with this depot's own the first time. Once both
+ * sides support binary frames, everything after this depot's answer is
+ * sent as frames, and a neighbour which understands routes is sent this
+ * depot's. The window which may follow 'credit' is the credit each side
+ * starts with: the neighbour grants it to this depot, which is limited to
+ * it from now on, and this depot grants its own to a neighbour which
+ * understands credit.
+ */
+void handle_caps_message(Depot* depot, Command* capsCommand) {
+    Neighbour* neighbour = capsCommand->source;
+    unsigned caps = 0;
+    unsigned long window = 0;
+    Field list = capsCommand->list;
+    Field name;
+    while (next_field(&list, &name)) {
+        unsigned named = 0;
+        for (size_t i = 0; i < sizeof(capabilityNames) / sizeof(char*); 
+                i++) {
+            if (field_equals(name, capabilityNames[i])) {
+                named = 1u << i;
+            }
+        }
+        caps |= named;
+        Field rest = list;
+        Field number;
+        if (named == CAP_CREDIT && next_field(&rest, &number) && 
+                parse_number(number, &window)) {
+            list = rest;
+        }
+    }
+    unsigned oldCaps = __atomic_exchange_n(&neighbour->caps, caps, 
+            __ATOMIC_ACQ_REL);
+    if (!__atomic_exchange_n(&neighbour->capsSent, true, __ATOMIC_ACQ_REL)) {
+        send_caps(neighbour);
+    }
+    if (depot->config.binary && (caps & ~oldCaps & CAP_BINARY)) {
+        switch_to_binary(neighbour);
+    }
+    if (caps & ~oldCaps & CAP_ROUTE) {
+        lock_depot();
+        advertise_routes(depot, depot->neighbourTable);
+        pthread_mutex_unlock(&depotLock);
+    }
+    if ((caps & ~oldCaps & CAP_CREDIT) && window > 0) {
+        __atomic_add_fetch(&neighbour->out.credit, 
+                (long long)(window < INT_MAX ? window : INT_MAX), 
+                __ATOMIC_RELAXED);
+        __atomic_store_n(&neighbour->out.limited, true, __ATOMIC_RELEASE);
+        wake_writer(neighbour);
+    }
+    if (depot->config.creditWindow > 0 && !neighbour->granting && 
+            (caps & CAP_CREDIT)) {
+        uint64_t handled = handled_bytes(&neighbour->reader);
+        neighbour->creditGranted = handled;
+        neighbour->creditHandled = handled;
+        __atomic_store_n(&neighbour->granting, true, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+ * Handles a 'Binary' message, after which the neighbour sends binary
+ * frames instead of lines. The switch is only honoured on a link where
+ * both sides have advertised binary; otherwise the message is invalid.
+ */
+void handle_binary_message(Depot* depot, Command* binaryCommand) {
+    Neighbour* neighbour = binaryCommand->source;
+    if (!depot->config.binary || 
+            !__atomic_load_n(&neighbour->capsSent, __ATOMIC_ACQUIRE) ||
+            !(__atomic_load_n(&neighbour->caps, __ATOMIC_ACQUIRE) & 
+            CAP_BINARY)) {
+        count(&thread_metrics()->parseFailures, 1);
+        return;
+    }
+    neighbour->reader.binary = true;
+}
+
+/*
+ * Handles a 'Credit' message, which lets this depot send the neighbour
+ * that many more bytes on top of the window in its 'Caps'
+ */
+void handle_credit_message(Depot* depot, Command* creditCommand) {
+    Neighbour* neighbour = creditCommand->source;
+    __atomic_add_fetch(&neighbour->out.credit, creditCommand->quantity, 
+            __ATOMIC_RELAXED);
+    __atomic_store_n(&neighbour->out.limited, true, __ATOMIC_RELEASE);
+    wake_writer(neighbour);
+}
+
+/*
+ * Returns a 'Caps' message listing the given capabilities, with the
+ * credit window this depot grants, if any, after 'credit'
+ */
+char* format_capabilities(unsigned caps, int creditWindow) {
+    size_t length = strlen("Caps\n") + 12;
+    for (size_t i = 0; i < sizeof(capabilityNames) / sizeof(char*); i++) {
+        if (caps & (1u << i)) {
+            length += strlen(capabilityNames[i]) + 1;
+        }
+    }
+    char* message = (char*)malloc(length + 1);
+    size_t used = sprintf(message, "Caps");
+    for (size_t i = 0; i < sizeof(capabilityNames) / sizeof(char*); i++) {
+        if (caps & (1u << i)) {
+            used += sprintf(message + used, ":%s", capabilityNames[i]);
+            if ((1u << i) == CAP_CREDIT && creditWindow > 0) {
+                used += sprintf(message + used, ":%d", creditWindow);
+            }
+        }
+    }
+    strcpy(message + used, "\n");
+    return message;
+}
+
+/*
+ * Splits a message into its fields in a single pass and checks them
+ * against its type. Fields are separated by one or more colons, except
+ * that a deferred task is everything after its key.
+ */
+bool parse_message(const char* message, Command* command) {
+    Field fields[MAX_FIELDS + 1];
+    int numFields = 0;
+    command->type = determine_message_type(message);
+    command->nameId = -1;
+    command->destId = -1;
+    const char* next = message;
+    while (*next != '\0' && numFields <= MAX_FIELDS) {
+        if (*next == ':') {
+            next++;
+            continue;
+        }
+        Field* field = &fields[numFields++];
+        field->start = next;
+        while (*next != '\0' && *next != ':') {
+            next++;
+        }
+        field->length = next - field->start;
+        if (command->type == DEFER && numFields == 2) {
+            command->task.start = *next == '\0' ? next : next + 1;
+            command->task.length = strlen(command->task.start);
+            break;
+        }
+        if ((command->type == BATCH || command->type == CAPS || 
+                command->type == ROUTE) && numFields == 1) {
+            command->list.start = next;
+            command->list.length = strlen(next);
+            break;
+        }
+    }
+    return parse_fields(command, fields, numFields);
+}
+
+/*
+ * Checks the fields of a message against its type and stores them in the
+ * command. Returns whether or not the message is valid.
+ */
+bool parse_fields(Command* command, Field* fields, int numFields) {
+    unsigned long number;
+    switch (command->type) {
+        case DELIVER:
+        case WITHDRAW:
+        case TRANSFER:
+            if (numFields != (command->type == TRANSFER ? 4 : 3) || 
+                    !parse_number(fields[1], &number) || (int)number <= 0) {
+                return false;
+            }
+            command->quantity = number;
+            command->name = fields[2];
+            command->dest = fields[3];
+            return true;
+        case IM:
+            command->port = fields[1];
+            command->name = fields[2];
+            return numFields == 3;
+        case CONNECT:
+            command->port = fields[1];
+            return numFields == 2;
+        case DEFER:
+        case EXECUTE:
+            if (numFields != 2 || !parse_number(fields[1], &number)) {
+                return false;
+            }
+            command->key = number;
+            return command->type == EXECUTE || command->task.length > 0;
+        case BATCH:
+            return valid_batch(command->list);
+        case CAPS:
+            return numFields == 1;
+        case BINARY:
+            return numFields == 1;
+        case ROUTE:
+            return valid_routes(command->list);
+        case FORWARD:
+            if (numFields != 5 || !parse_number(fields[1], &number) || 
+                    (int)number <= 0) {
+                return false;
+            }
+            command->quantity = number;
+            command->name = fields[2];
+            command->dest = fields[3];
+            if (!parse_number(fields[4], &number) || number == 0 || 
+                    number > ROUTE_INFINITY) {
+                return false;
+            }
+            command->hops = number;
+            return true;
+        case CREDIT:
+            if (numFields != 2 || !parse_number(fields[1], &number) || 
+                    (int)number <= 0) {
+                return false;
+            }
+            command->quantity = number;
+            return true;
+        default:
+            return false;
+    }
+}
+
+/*
+ * Parses a field as a base 10 number in the same way as strtoul, failing
+ * unless the whole field is used
+ */
+bool parse_number(Field field, unsigned long* number) {
+    const char* next = field.start;
+    const char* end = field.start + field.length;
+    while (next < end && isspace((unsigned char)*next)) {
+        next++;
+    }
+    bool negative = false;
+    if (next < end && (*next == '+' || *next == '-')) {
+        negative = *next++ == '-';
+    }
+    if (next == end) {
+        return false;
+    }
+    unsigned long result = 0;
+    bool overflow = false;
+    for (; next < end; next++) {
+        if (!isdigit((unsigned char)*next)) {
+            return false;
+        }
+        unsigned long digit = *next - '0';
+        if (result > (ULONG_MAX - digit) / 10) {
+            overflow = true;
+        }
+        result = result * 10 + digit;
+    }
+    *number = overflow ? ULONG_MAX : (negative ? -result : result);
+    return true;
+}
+
+/*
+ * Splits the next field off the front of a colon separated list, skipping
+ * any empty fields. Returns false once the list is used up.
+ */
+bool next_field(Field* list, Field* field) {
+    const char* next = list->start;
+    const char* end = list->start + list->length;
+    while (next < end && *next == ':') {
+        next++;
+    }
+    if (next == end) {
+        list->start = end;
+        list->length = 0;
+        return false;
+    }
+    field->start = next;
+    while (next < end && *next != ':') {
+        next++;
+    }
+    field->length = next - field->start;
+    list->start = next;
+    list->length = end - next;
+    return true;
+}
+
+/*
+ * Reads the next operation of a batch, a signed quantity followed by a
+ * name, from the front of its list. Returns false at the end of the list
+ * or if the operation is malformed.
+ */
+bool next_batch_op(Field* list, long* quantity, Field* name) {
+    Field number;
+    if (!next_field(list, &number) || !next_field(list, name)) {
+        return false;
+    }
+    const char* next = number.start;
+    const char* end = number.start + number.length;
+    bool negative = *next == '-';
+    if (*next == '-' || *next == '+') {
+        next++;
+    }
+    if (next == end) {
+        return false;
+    }
+    long value = 0;
+    for (; next < end; next++) {
+        if (!isdigit((unsigned char)*next)) {
+            return false;
+        }
+        value = value * 10 + (*next - '0');
+        if (value > INT_MAX) {
+            return false;
+        }
+    }
+    *quantity = negative ? -value : value;
+    return value != 0;
+}
+
+/*
+ * Check for whether or not a batch holds at least one operation and every
+ * operation in it is well formed
+ */
+bool valid_batch(Field list) {
+    long quantity;
+    Field name;
+    int numOps = 0;
+    while (1) {
+        Field rest = list;
+        if (!next_field(&rest, &name)) {
+            return numOps > 0;
+        }
+        if (!next_batch_op(&list, &quantity, &name)) {
+            return false;
+        }
+        numOps++;
+    }
+}
+
+/*
+ * Check for whether or not a field holds exactly the given string
+ */
+bool field_equals(Field field, const char* string) {
+    return strncmp(string, field.start, field.length) == 0 && 
+            string[field.length] == '\0';
+}
+
+/*
+ * Returns the calling thread's metrics, claiming those given up by an
+ * exited thread or registering new ones on first use
+ */
+ThreadMetrics* thread_metrics(void) {
+    if (threadMetrics) {
+        return threadMetrics;
+    }
+    for (ThreadMetrics* metrics = __atomic_load_n(&metricsList, 
+            __ATOMIC_ACQUIRE); metrics; metrics = metrics->next) {
+        bool claimed = false;
+        if (__atomic_compare_exchange_n(&metrics->claimed, &claimed, true, 
+                false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            threadMetrics = metrics;
+            return metrics;
+        }
+    }
+    ThreadMetrics* metrics = (ThreadMetrics*)calloc(1, 
+            sizeof(ThreadMetrics));
+    metrics->claimed = true;
+    metrics->next = __atomic_load_n(&metricsList, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&metricsList, &metrics->next, 
+            metrics, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+    threadMetrics = metrics;
+    return metrics;
+}
+
+/*
+ * Gives up the calling thread's metrics before it exits, leaving its
+ * counts in the totals
+ */
+void release_thread_metrics(void) {
+    if (threadMetrics) {
+        __atomic_store_n(&threadMetrics->claimed, false, __ATOMIC_RELEASE);
+        threadMetrics = NULL;
+    }
+}
+
+/*
+ * Adds to one of the calling thread's own counters. Only the owner
+ * writes, so a plain load and store is enough for the dump to see a whole
+ * value.
+ */
+void count(uint64_t* counter, uint64_t amount) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + 
+            amount, __ATOMIC_RELAXED);
+}
+
+/*
+ * Records a time in one of the calling thread's own histograms
+ */
+void record_time(Histogram* histogram, uint64_t nanoseconds) {
+    count(&histogram->counts[histogram_bucket(nanoseconds)], 1);
+    if (nanoseconds > histogram->max) {
+        __atomic_store_n(&histogram->max, nanoseconds, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Finds the histogram bucket for a value. Values below 2^HISTOGRAM_SUB_BITS
+ * have a bucket each; above that, each power of two is split evenly.
+ */
+int histogram_bucket(uint64_t value) {
+    int subBuckets = 1 << HISTOGRAM_SUB_BITS;
+    if (value < (uint64_t)subBuckets) {
+        return value;
+    }
+    int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+    int bucket = (shift + 1) * subBuckets + 
+            ((value >> shift) & (subBuckets - 1));
+    return bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS - 1;
+}
+
+/*
+ * Returns the largest value which falls in the given bucket
+ */
+uint64_t bucket_limit(int bucket) {
+    int subBuckets = 1 << HISTOGRAM_SUB_BITS;
+    if (bucket < subBuckets) {
+        return bucket;
+    }
+    int shift = bucket / subBuckets - 1;
+    uint64_t start = (uint64_t)(subBuckets + bucket % subBuckets) << shift;
+    return start + ((uint64_t)1 << shift) - 1;
+}
+
+/*
+ * Returns the value below which the given fraction of a histogram's
+ * values fall, rounded up to the end of its bucket
+ */
+uint64_t histogram_percentile(Histogram* histogram, uint64_t total, 
+        double percentile) {
+    uint64_t rank = (uint64_t)(percentile * total);
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen > rank) {
+            uint64_t limit = bucket_limit(i);
+            return limit < histogram->max ? limit : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+/*
+ * Prints the metrics summed over every thread as a single line of JSON,
+ * along with the traffic to and from each neighbour
+ */
+void dump_metrics(Depot* depot) {
+    ThreadMetrics* total = (ThreadMetrics*)calloc(1, sizeof(ThreadMetrics));
+    for (ThreadMetrics* metrics = __atomic_load_n(&metricsList, 
+            __ATOMIC_ACQUIRE); metrics; metrics = metrics->next) {
+        for (int type = 0; type <= INVALID; type++) {
+            total->messages[type] += __atomic_load_n(
+                    &metrics->messages[type], __ATOMIC_RELAXED);
+            Histogram* from = &metrics->latency[type];
+            Histogram* to = &total->latency[type];
+            for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+                to->counts[i] += __atomic_load_n(&from->counts[i], 
+                        __ATOMIC_RELAXED);
+            }
+            uint64_t max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+            to->max = max > to->max ? max : to->max;
+        }
+        total->parseFailures += __atomic_load_n(&metrics->parseFailures, 
+                __ATOMIC_RELAXED);
+        total->coalesced += __atomic_load_n(&metrics->coalesced, 
+                __ATOMIC_RELAXED);
+        total->lockAcquisitions += __atomic_load_n(
+                &metrics->lockAcquisitions, __ATOMIC_RELAXED);
+        total->lockWaitNs += __atomic_load_n(&metrics->lockWaitNs, 
+                __ATOMIC_RELAXED);
+    }
+
+    fprintf(stdout, "{\"messages\":{");
+    for (int type = CONNECT; type <= INVALID; type++) {
+        fprintf(stdout, "%s\"%s\":%llu", type == CONNECT ? "" : ",", 
+                messageTypeNames[type], 
+                (unsigned long long)total->messages[type]);
+    }
+    fprintf(stdout, "},\"parseFailures\":%llu,\"coalesced\":%llu,"
+            "\"depotLock\":{\"acquisitions\":%llu,\"waitNs\":%llu},"
+            "\"handlerNs\":{", (unsigned long long)total->parseFailures, 
+            (unsigned long long)total->coalesced, 
+            (unsigned long long)total->lockAcquisitions, 
+            (unsigned long long)total->lockWaitNs);
+    bool first = true;
+    for (int type = CONNECT; type < INVALID; type++) {
+        if (total->messages[type] == 0) {
+            continue;
+        }
+        fprintf(stdout, "%s\"%s\":", first ? "" : ",", 
+                messageTypeNames[type]);
+        dump_histogram(&total->latency[type]);
+        first = false;
+    }
+    rcu_read_lock();
+    NeighbourTable* table = read_neighbours(depot);
+    fprintf(stdout, "},\"connections\":{\"live\":%d,\"closed\":%llu},"
+            "\"neighbours\":[", table->numNeighbours, 
+            (unsigned long long)__atomic_load_n(&depot->connectionsClosed, 
+            __ATOMIC_RELAXED));
+    for (int i = 0; i < table->numNeighbours; i++) {
+        Neighbour* neighbour = table->neighbours[i];
+        fprintf(stdout, "%s{\"name\":", i == 0 ? "" : ",");
+        dump_string(name_text(neighbour->nameId));
+        fprintf(stdout, ",\"port\":");
+        dump_string(neighbour->port);
+        fprintf(stdout, ",\"bytesIn\":%llu,\"bytesOut\":%llu}", 
+                (unsigned long long)__atomic_load_n(
+                &neighbour->reader.received, __ATOMIC_RELAXED), 
+                (unsigned long long)__atomic_load_n(&neighbour->out.sent, 
+                __ATOMIC_RELAXED));
+    }
+    rcu_read_unlock();
+    fprintf(stdout, "]}\n");
+    fflush(stdout);
+    free(total);
+}
+
+/*
+ * Prints a histogram as JSON: its count, percentiles and the end of each
+ * non-empty bucket with how many values fell in it
+ */
+void dump_histogram(Histogram* histogram) {
+    uint64_t total = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        total += histogram->counts[i];
+    }
+    fprintf(stdout, "{\"count\":%llu,\"p50\":%llu,\"p90\":%llu,"
+            "\"p99\":%llu,\"p999\":%llu,\"max\":%llu,\"buckets\":[", 
+            (unsigned long long)total, 
+            (unsigned long long)histogram_percentile(histogram, total, 0.5), 
+            (unsigned long long)histogram_percentile(histogram, total, 0.9), 
+            (unsigned long long)histogram_percentile(histogram, total, 
+            0.99), 
+            (unsigned long long)histogram_percentile(histogram, total, 
+            0.999), 
+            (unsigned long long)histogram->max);
+    bool first = true;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        if (histogram->counts[i] == 0) {
+            continue;
+        }
+        fprintf(stdout, "%s[%llu,%llu]", first ? "" : ",", 
+                (unsigned long long)bucket_limit(i), 
+                (unsigned long long)histogram->counts[i]);
+        first = false;
+    }
+    fprintf(stdout, "]}");
+}
+
+/*
+ * Prints a string as a quoted JSON string
+ */
+void dump_string(const char* string) {
+    fputc('"', stdout);
+    for (; *string; string++) {
+        unsigned char c = *string;
+        if (c == '"' || c == '\\') {
+            fprintf(stdout, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(stdout, "\\u%04x", c);
+        } else {
+            fputc(c, stdout);
+        }
+    }
+    fputc('"', stdout);
+}
+
+/*
+ * Current time in nanoseconds from a monotonic clock
+ */
+long long now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+ * Initialises the thread used for handling signals
+ */
+void init_sig(Depot* depot) {
+    pthread_t tid;
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGPIPE);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, 0);
+    pthread_create(&tid, 0, handle_signals, 0);
+}
+
+/*
+ * Signal handler for catching SIGHUP, SIGUSR1 and SIGPIPE
+ */
+void* handle_signals(void* arg) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGPIPE);
+    sigaddset(&set, SIGUSR1);
+    int sigNum;
+    while (!sigwait(&set, &sigNum)) {
+        if (sigNum == 1) {
+            print_info(depotCpy);
+        } else if (sigNum == SIGUSR1) {
+            dump_metrics(depotCpy);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Custom comparator for comparing resources
+ */
+int comp_resources(const void* v1, const void* v2) {
+    Resource* x1 = (Resource*)v1;
+    Resource* x2 = (Resource*)v2;
+    return strcmp(name_text(x1->nameId), name_text(x2->nameId));
+}
+
+/*
+ * Custom comparator for comparing interned names, such as those of
+ * neighbours
+ */
+int comp_names(const void* v1, const void* v2) {
+    int x1 = *((int*)v1);
+    int x2 = *((int*)v2);
+    return strcmp(name_text(x1), name_text(x2));
+}
+
+/*
+ * Custom comparator for ordering log generations
+ */
+int comp_generations(const void* v1, const void* v2) {
+    unsigned x1 = *((unsigned*)v1);
+    unsigned x2 = *((unsigned*)v2);
+    return (x1 > x2) - (x1 < x2);
+}
+
+/*
+ * Reads a non-negative integer setting from the environment, falling back
+ * to the default when it is unset or malformed
+ */
+int env_int(const char* name, int defaultValue) {
+    char* value = getenv(name);
+    if (!value || strlen(value) == 0) {
+        return defaultValue;
+    }
+    char* err;
+    long result = strtol(value, &err, 10);
+    if (*err != '\0' || result < 0) {
+        return defaultValue;
     }
-    strResult[length++] = '\0';
-    return (char*)realloc(strResult, sizeof(char) * length);
+    return (int)result;
 }
 
 /*
@@ -647,7 +5610,7 @@ bool contains_bad_char(char* argument) {
 /*
  * Determines the message type of the given message
  */
-MessageType determine_message_type(char* message) {
+MessageType determine_message_type(const char* message) {
     if (strncmp(message, "Connect", 7) == 0) {
         return CONNECT;
     } else if (strncmp(message, "IM", 2) == 0) {
@@ -662,6 +5625,18 @@ MessageType determine_message_type(char* message) {
         return EXECUTE;
     } else if (strncmp(message, "Transfer", 8) == 0) {
         return TRANSFER;
+    } else if (strncmp(message, "Batch", 5) == 0) {
+        return BATCH;
+    } else if (strncmp(message, "Caps", 4) == 0) {
+        return CAPS;
+    } else if (strncmp(message, "Binary", 6) == 0) {
+        return BINARY;
+    } else if (strncmp(message, "Route", 5) == 0) {
+        return ROUTE;
+    } else if (strncmp(message, "Forward", 7) == 0) {
+        return FORWARD;
+    } else if (strncmp(message, "Credit", 6) == 0) {
+        return CREDIT;
     }
     return INVALID;
 }
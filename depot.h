@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,14 +7,126 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <signal.h>
+#include <errno.h>
+#include <ctype.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <time.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef DEPOT_URING
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
 
 #define LOCALHOST "127.0.0.1"
 
+/* Default time in milliseconds for a new connection to exchange IMs */
+#define HANDSHAKE_TIMEOUT_MS 5000
+/* Maximum number of epoll events handled per wakeup of an event loop */
+#define EVENT_BATCH 64
+/* Initial number of slots in the deferred task table */
+#define DEFERRED_TABLE_SIZE 16
+/* Smallest and largest number of tasks in a block of deferred tasks */
+#define TASK_CHUNK_MIN 16
+#define TASK_CHUNK_MAX 4096
+/* Most fields a message can have, counting its type */
+#define MAX_FIELDS 5
+/* Most messages queued for a neighbour before reading from whoever adds to
+ * it is held back until it drains to half that */
+#define OUT_QUEUE_LIMIT 65536
+/* Most messages queued for a neighbour, however they were added, before its
+ * connection is closed */
+#define OUT_QUEUE_CAP (16 * OUT_QUEUE_LIMIT)
+/* Default bytes a neighbour may send beyond what this depot has handled */
+#define CREDIT_WINDOW (1 << 20)
+/* Most tasks a handler gathers for a shard before handing them over */
+#define SHARD_BATCH 256
+/* Most messages gathered into a single write to a neighbour */
+#define OUT_BATCH 256
+/* Default time between snapshots of a persistent depot */
+#define SNAPSHOT_INTERVAL_MS 60000
+/* Marks the start of a snapshot file, with its format version */
+#define SNAPSHOT_MAGIC "DEPOTSN1"
+/* Initial size of the write-ahead log's buffer */
+#define WAL_BUFFER_SIZE 65536
+/* Each power of two in a latency histogram is split into 2^n buckets */
+#define HISTOGRAM_SUB_BITS 3
+/* Buckets in a latency histogram, enough for times up to 2^40ns */
+#define HISTOGRAM_BUCKETS 312
+/* Longest binary frame accepted from a neighbour */
+#define MAX_FRAME_LENGTH (1 << 24)
+/* Most names each side of a binary link gives short IDs to */
+#define MAX_WIRE_NAMES 65536
+/* Most bytes in an encoded varint */
+#define VARINT_MAX 10
+/* First byte of a binary frame which carries a text message */
+#define FRAME_TEXT 0
+/* Distance at which a depot counts as unreachable, which is also the most
+ * hops a forwarded delivery may take */
+#define ROUTE_INFINITY 16
+/* Initial size of a connection's receive buffer */
+#define LINE_BUFFER_SIZE 4096
+/* Most threads used to parse a goods file, and the least of the file
+ * each one is given */
+#define GOODS_FILE_THREADS 16
+#define GOODS_CHUNK_MIN (1 << 18)
+/* Entries in the submission queue of each io_uring */
+#define URING_ENTRIES 1024
+/* Number and size of the receive buffers each io_uring event loop provides
+ * to the kernel. The number must be a power of two. */
+#define URING_BUFFERS 256
+#define URING_BUFFER_SIZE 16384
+/* Number of entries in the first chunk of the name and resource tables.
+ * Each later chunk is double the size of the one before it. */
+#define TABLE_CHUNK_SIZE 16
+/* Maximum number of chunks in the name and resource tables */
+#define TABLE_CHUNKS 32
+
 
 typedef struct Neighbour Neighbour;
 typedef struct Depot Depot;
 typedef struct Resource Resource;
+typedef struct Name Name;
+typedef struct NameIndex NameIndex;
+typedef struct NameTable NameTable;
 typedef struct DeferredTask DeferredTask;
+typedef struct Task Task;
+typedef struct TaskChunk TaskChunk;
+typedef struct DepotConfig DepotConfig;
+typedef struct GoodsChunk GoodsChunk;
+typedef struct EventLoop EventLoop;
+typedef struct LineReader LineReader;
+typedef struct OutMessage OutMessage;
+typedef struct OutQueue OutQueue;
+typedef struct Field Field;
+typedef struct Command Command;
+typedef struct CommandHandler CommandHandler;
+typedef struct Handshake Handshake;
+typedef struct Connector Connector;
+typedef struct ByteBuffer ByteBuffer;
+typedef struct ByteReader ByteReader;
+typedef struct WriteAheadLog WriteAheadLog;
+typedef struct NeighbourTable NeighbourTable;
+typedef struct RcuReader RcuReader;
+typedef struct Route Route;
+typedef struct RouteEntry RouteEntry;
+typedef struct Histogram Histogram;
+typedef struct ThreadMetrics ThreadMetrics;
+typedef struct Ring Ring;
+typedef struct Shard Shard;
+typedef struct ShardBatch ShardBatch;
+typedef struct ShardChange ShardChange;
 
 /*
  * Exit statuses for the depot
@@ -21,7 +134,8 @@ typedef struct DeferredTask DeferredTask;
 typedef enum {
     BAD_ARG_NUM = 1,
     BAD_NAME = 2,
-    BAD_QUANTITY = 3
+    BAD_QUANTITY = 3,
+    BAD_GOODS_FILE = 4
 } DepotStatus;
 
 /*
@@ -35,27 +149,640 @@ typedef enum {
     TRANSFER = 5,
     DEFER = 6,
     EXECUTE = 7,
-    INVALID = 8
+    BATCH = 8,
+    CAPS = 9,
+    BINARY = 10,
+    ROUTE = 11,
+    FORWARD = 12,
+    CREDIT = 13,
+    INVALID = 14
 } MessageType;
 
+/*
+ * Optional protocol features a depot can advertise to a neighbour with a
+ * 'Caps' message, each a bit in a set. A feature is only used towards a
+ * neighbour which has advertised it, so depots without Caps, which ignore
+ * the message, still work.
+ */
+typedef enum {
+    CAP_BATCH = 1,
+    CAP_BINARY = 2,
+    CAP_ROUTE = 4,
+    CAP_CREDIT = 8
+} Capability;
+
+/*
+ * Types of record in the write-ahead log
+ */
+typedef enum {
+    RECORD_DELTA = 1,
+    RECORD_DEFER = 2,
+    RECORD_EXECUTE = 3,
+    RECORD_BATCH = 4
+} RecordType;
+
+/*
+ * Receive buffer which splits the bytes arriving on a connection into
+ * lines, or into binary frames once the other end has switched to them.
+ * Lines handed out point into the buffer and stay valid until the reader
+ * is next used.
+ */
+struct LineReader {
+    int fd;
+    char* buffer;
+    size_t start;
+    size_t length;
+    size_t capacity;
+    bool eof;
+
+    // Whether the other end now sends binary frames, and the name ID of
+    // each wire ID it has defined in them
+    bool binary;
+    int* wireNames;
+    int numWireNames;
+    int wireNamesCapacity;
+
+    // Total bytes read, updated atomically for the stats dump
+    uint64_t received;
+};
+
+/*
+ * Stages of making an outbound connection, or of an accepted one which
+ * has yet to send its IM
+ */
+typedef enum {
+    QUEUED,
+    CONNECTING,
+    AWAITING_IM,
+    ACCEPTED
+} HandshakeState;
+
+/*
+ * Outcomes of advancing a handshake
+ */
+typedef enum {
+    HANDSHAKE_PENDING,
+    HANDSHAKE_DONE,
+    HANDSHAKE_FAILED
+} HandshakeResult;
+
+/*
+ * A field within a message. Fields point into the message and are not
+ * terminated, so each comes with its length.
+ */
+struct Field {
+    const char* start;
+    size_t length;
+};
+
+/*
+ * A message split into its fields by parse_message. Only the fields used
+ * by the message's type are set. A Batch, Caps or Route message keeps
+ * everything after its type as a list, split up by next_field when it is
+ * used. A message decoded from a binary frame has its names already
+ * interned.
+ */
+struct Command {
+    MessageType type;
+    int quantity;
+    unsigned key;
+    Field name;
+    Field dest;
+    int nameId;
+    int destId;
+    Field port;
+    Field task;
+    Field list;
+    int hops;
+
+    // Neighbour the message came from, set by handle_message
+    Neighbour* source;
+};
+
+/*
+ * Entry in the table of handlers for each message type
+ */
+struct CommandHandler {
+    void (*handle)(Depot* depot, Command* command);
+    bool needsLock;
+};
+
+/*
+ * A Deliver, Withdraw or Transfer with its names interned
+ */
+struct Task {
+    MessageType type;
+    int quantity;
+    int nameId;
+    int destId;
+};
+
+/*
+ * A message waiting to be sent to a neighbour. A task is only encoded, as
+ * text or a binary frame, by the writer when it takes the message off the
+ * queue; anything else is queued already formatted as text, with task.type
+ * set to INVALID, to BINARY for the line which switches to frames or to
+ * CREDIT for a grant of credit.
+ */
+struct OutMessage {
+    OutMessage* next;
+    Task task;
+    size_t length;
+    // Whether the message has been counted against the neighbour's credit
+    // and handed to a write
+    bool charged;
+    // How much of the log must be synced before the message is sent, so
+    // that no neighbour sees the effect of a change a crash could undo
+    uint64_t lsn;
+    char text[];
+};
+
+/*
+ * Messages waiting to be sent to a neighbour. Any thread may push onto
+ * stack without a lock. Whoever holds lock takes the whole stack at once
+ * and appends it, oldest first, to pending before writing it out.
+ */
+struct OutQueue {
+    OutMessage* stack;
+    int queued;
+    bool signalled;
+    bool closed;
+
+    // Total bytes written, updated atomically for the stats dump
+    uint64_t sent;
+
+    // Guarded by lock
+    pthread_mutex_t lock;
+    OutMessage* pending;
+    OutMessage* pendingTail;
+    size_t pendingSent;
+
+    // Guarded by lock. Whether messages are now encoded as binary frames,
+    // and the wire ID plus one given to each name ID sent in them so far.
+    bool binary;
+    int* wireIds;
+    int wireIdsSize;
+    int numWireIds;
+
+    // Whether runs of deliveries are merged as they are taken
+    bool coalesce;
+
+    // Wakes a writer thread; unused by event loops
+    int wakeFd;
+    // Whether an event loop is waiting for the socket to take more
+    bool blocked;
+
+    // Whether the queue is counted among the depot's backlogged queues,
+    // updated atomically
+    bool backlogged;
+    // The lsn the first pending message is waiting to have synced, or 0
+    // if none is. Set under lock; the log thread reads it atomically.
+    uint64_t awaitedLsn;
+
+    // Guarded by lock. Whether a send handed to an io_uring has yet to
+    // complete, and the header and iovecs it writes from, which must stay
+    // put until it does. Nothing else is written meanwhile.
+    bool inFlight;
+    struct msghdr header;
+    struct iovec* iov;
+
+    // Bytes the neighbour will still take, once the window in its 'Caps'
+    // or a 'Credit' message from it has set limited, and credit it has been granted but not yet queued,
+    // all updated atomically. Like the neighbour, credit counts everything
+    // after the 'Caps' this depot sent it, so it is charged from then on,
+    // as counting says. grantsQueued and counting are guarded by lock;
+    // grantsQueued counts the 'Credit' messages pending and not yet
+    // charged.
+    long long credit;
+    bool limited;
+    long long grant;
+    int grantsQueued;
+    bool counting;
+};
+
 /*
  * Stores details of a neighbour
  */
 struct Neighbour {
-    char* neighbourName;
-    FILE* toNeighbour;
-    FILE* fromNeighbour;
+    int nameId;
+    LineReader reader;
+    OutQueue out;
     Depot* depot;
     pthread_t threadID;
+    pthread_t writerID;
     char* port;
+
+    // Event loop which services the neighbour, if any, and the link in
+    // that loop's list of neighbours with messages to send
+    EventLoop* loop;
+    Neighbour* nextDirty;
+
+    // Link in the loop's list of closed neighbours waiting to be freed
+    Neighbour* nextDeparted;
+
+    // Whether something the neighbour sent has added to another
+    // neighbour's backlogged queue since the depot's backlog last drained.
+    // Only used by whatever reads from the neighbour.
+    bool feeding;
+
+    // Whether the loop has stopped reading from the neighbour until the
+    // depot's backlog drains, and whether an io_uring receive from it is
+    // under way. Only used by the loop.
+    bool held;
+    bool receiving;
+
+    // Capabilities the neighbour has advertised, and whether this depot
+    // has advertised its own in return
+    unsigned caps;
+    bool capsSent;
+
+    // Distances to other depots the neighbour last advertised in a
+    // 'Route' message, and the last one sent to it. Guarded by depotLock.
+    RouteEntry* advertised;
+    int numAdvertised;
+    char* routesSent;
+
+    // Whether this depot grants the neighbour credit, how far into what
+    // the neighbour sent it had handled when it last did, and how far it
+    // has now, all updated atomically. The neighbour may go on sending for
+    // a window beyond creditGranted. messageStart, only used by whatever
+    // reads from the neighbour, is where the message being handled began.
+    bool granting;
+    uint64_t creditGranted;
+    uint64_t creditHandled;
+    uint64_t messageStart;
+};
+
+/*
+ * Immutable set of the depot's neighbours, with open addressing indexes
+ * by name ID and by port which may hold duplicates. Adding a neighbour
+ * builds and publishes a new table, so handlers look neighbours up
+ * without a lock; a replaced table is freed once no reader can still be
+ * using it.
+ */
+struct NeighbourTable {
+    int numNeighbours;
+    int indexSize;
+    Neighbour** byName;
+    Neighbour** byPort;
+
+    // Shortest known route to each name ID below numRoutes, worked out
+    // from the neighbours' advertised distances when the table is
+    // published. via is NULL where no route is known.
+    int numRoutes;
+    Route* routes;
+
+    // Set when the table is replaced, along with the neighbour it no
+    // longer holds, if any, which is released with the table. Guarded by
+    // depotLock.
+    NeighbourTable* nextRetired;
+    uint64_t retiredEpoch;
+    Neighbour* departed;
+
+    Neighbour* neighbours[];
+};
+
+/*
+ * Neighbour through which deliveries to a depot are passed on, and how
+ * many hops away the depot is that way
+ */
+struct Route {
+    Neighbour* via;
+    int distance;
+};
+
+/*
+ * A depot's distance from a neighbour, as advertised in a 'Route' message
+ */
+struct RouteEntry {
+    int nameId;
+    int distance;
+};
+
+/*
+ * Announces which published tables a thread may be reading. epoch is the
+ * global epoch when the thread's outermost read section began, or zero
+ * outside any. Entries are never freed; one given up by a thread which
+ * has exited is claimed by the next new reader.
+ */
+struct RcuReader {
+    RcuReader* next;
+    uint64_t epoch;
+    int depth;
+    bool claimed;
 };
 
 /*
- * Stores details of a resource
+ * Stores details of a resource. The resource table has an entry for every
+ * interned name, and a resource the depot has never seen has no stock.
  */
 struct Resource {
-    int quantity;
-    char* resourceName;
+    // Updated with atomic operations, never under a lock
+    long long quantity;
+    int nameId;
+};
+
+/*
+ * An interned resource or depot name
+ */
+struct Name {
+    char* text;
+    unsigned long hash;
+};
+
+/*
+ * Open addressing index over the name table. Each slot holds the ID of a
+ * name plus one, or zero when empty. Slots are only ever filled once, so
+ * readers may probe without taking a lock.
+ */
+struct NameIndex {
+    int size;
+    NameIndex* retired;
+    int slots[];
+};
+
+/*
+ * Process-wide table holding each distinct resource and depot name once.
+ * A name's ID is its position in the table. Names live in chunks which
+ * are never moved; numNames and index are published atomically and
+ * everything else is guarded by nameLock.
+ */
+struct NameTable {
+    int numNames;
+    int capacity;
+    int numChunks;
+    Name* chunks[TABLE_CHUNKS];
+    NameIndex* index;
+};
+
+/*
+ * Runtime options for the depot, read from the environment at startup
+ */
+struct DepotConfig {
+    int eventWorkers;
+    int handshakeTimeout;
+    char* dataDir;
+    int snapshotInterval;
+    bool binary;
+    int coalesceWindow;
+    int creditWindow;
+    int shards;
+    char* goodsFile;
+    bool uring;
+};
+
+/*
+ * Part of a goods file being parsed by its own thread, which turns each
+ * whole line starting in it into a delivery. status is set to why the
+ * first bad line was rejected, if any was.
+ */
+struct GoodsChunk {
+    pthread_t threadID;
+    const char* start;
+    const char* end;
+    Task* tasks;
+    int numTasks;
+    int capacity;
+    DepotStatus status;
+};
+
+/*
+ * Counts of times falling in log-linear buckets, so each is recorded to
+ * within an eighth of its size
+ */
+struct Histogram {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t max;
+};
+
+/*
+ * Counters kept by each thread which handles messages. Only the owning
+ * thread updates them, so recording takes no lock and no atomic
+ * read-modify-write; the stats dump sums every thread's counters.
+ * Entries are never freed; one given up by a thread which has exited is
+ * claimed by the next new thread, which carries on its counts.
+ */
+struct ThreadMetrics {
+    ThreadMetrics* next;
+    bool claimed;
+    uint64_t messages[INVALID + 1];
+    uint64_t parseFailures;
+    uint64_t coalesced;
+    uint64_t lockAcquisitions;
+    uint64_t lockWaitNs;
+    Histogram latency[INVALID + 1];
+};
+
+/*
+ * Growable run of bytes used to encode log records and snapshots
+ */
+struct ByteBuffer {
+    char* data;
+    size_t length;
+    size_t capacity;
+};
+
+/*
+ * Position within encoded bytes. Reading past the end sets failed and
+ * yields zeroes.
+ */
+struct ByteReader {
+    const char* next;
+    const char* end;
+    bool failed;
+};
+
+/*
+ * Append-only log of every change made to the depot's state, kept in
+ * DEPOT_DATA_DIR as a numbered file per generation. Changes are encoded
+ * into buffer and a log thread writes and syncs whatever has built up
+ * each time round, so one sync covers many changes. A snapshot starts a
+ * new generation, after which older files are removed.
+ */
+struct WriteAheadLog {
+    bool enabled;
+    int fd;
+    unsigned generation;
+
+    // Guarded by lock. The log thread swaps buffer with spare while it
+    // writes, setting writing until the write has been synced.
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    ByteBuffer buffer;
+    ByteBuffer spare;
+    bool writing;
+    size_t sinceSnapshot;
+    // Bytes ever logged and how many of them are known to be synced, which
+    // serve as log sequence numbers. synced is also read without the lock.
+    uint64_t appended;
+    uint64_t synced;
+    // The file a snapshot has opened for the next generation, taking over
+    // from rotateAt in the log, until the log thread switches to it. -1 if
+    // there is none.
+    int nextFd;
+    uint64_t rotateAt;
+
+    pthread_t threadID;
+    pthread_t snapshotThreadID;
+};
+
+/*
+ * Stores details of an epoll worker which owns a set of connections
+ */
+struct EventLoop {
+    int epollFd;
+    pthread_t threadID;
+    Depot* depot;
+
+    // Neighbours handed to this loop but not yet registered with epoll.
+    // Guarded by lock; the loop is woken through wakeFd.
+    int wakeFd;
+    pthread_mutex_t lock;
+    int numAdopted;
+    int adoptedCapacity;
+    Neighbour** adopted;
+
+    // Neighbours with messages to send, pushed without a lock
+    Neighbour* dirty;
+
+    // Holds back flushing the dirty neighbours for the coalescing window
+    int timerFd;
+    bool timerArmed;
+
+    // Closed neighbours which no other thread can reach any more, freed
+    // by the loop once it has flushed them from its dirty list. Guarded
+    // by lock.
+    Neighbour* departed;
+
+    // io_uring the loop waits on in place of epoll, if DEPOT_URING is set
+    Ring* ring;
+
+    // Neighbours the loop has stopped reading from, looked at again each
+    // time it is woken. Only used by the loop.
+    int numHeld;
+    int heldCapacity;
+    Neighbour** held;
+};
+
+#ifdef DEPOT_URING
+/*
+ * What a completion on an io_uring is for, kept in the low bits of its
+ * user data alongside the neighbour, if any
+ */
+typedef enum {
+    URING_WAKE = 1,
+    URING_TIMER = 2,
+    URING_RECV = 3,
+    URING_SEND = 4,
+    URING_ACCEPT = 5,
+    URING_CANCEL = 6,
+    URING_TAG_MASK = 7
+} UringTag;
+
+/*
+ * An io_uring set up with raw system calls, along with the ring of
+ * receive buffers it provides to the kernel, if any. Only the thread
+ * which owns it submits to it or reaps its completions.
+ */
+struct Ring {
+    int fd;
+    unsigned entries;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned sqMask;
+    struct io_uring_sqe* sqes;
+    unsigned tail;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe* cqes;
+
+    struct io_uring_buf_ring* bufRing;
+    char* buffers;
+    unsigned short bufTail;
+};
+#endif
+
+/*
+ * A connection which has not yet finished exchanging IMs, either made by
+ * this depot to port or accepted from another depot, in which case port
+ * and imMessage are NULL
+ */
+struct Handshake {
+    Handshake* next;
+    HandshakeState state;
+    char* port;
+    LineReader reader;
+    char* imMessage;
+    size_t imSent;
+    long long deadline;
+};
+
+/*
+ * Background thread which makes outbound connections and runs the
+ * handshakes of both those and accepted ones, so a slow peer never holds
+ * up message handling or further accepts. Handlers and the accept loop
+ * queue a handshake and wake the thread through wakeFd.
+ */
+struct Connector {
+    int epollFd;
+    int wakeFd;
+    pthread_t threadID;
+    pthread_mutex_t lock;
+    Handshake* handshakes;
+};
+
+/*
+ * Deliveries, withdrawals and transfers gathered by one thread for the
+ * worker of the shard which owns their resources or, with no tasks, a
+ * change it shares with other shards. A batch carrying a change is only
+ * allocated up to tasks.
+ */
+struct ShardBatch {
+    ShardBatch* next;
+    ShardChange* change;
+    int numTasks;
+    Task tasks[SHARD_BATCH];
+};
+
+/*
+ * A Batch, Execute or other change touching the resources of several
+ * shards, which must be applied as one. It is queued to each of them
+ * behind whatever they were already handed. The last of them to reach it
+ * applies it while the others wait, so none of them runs anything queued
+ * after it first.
+ */
+struct ShardChange {
+    // Shards yet to reach it, and threads yet to let go of it, both
+    // updated atomically. applied is guarded by shardLock.
+    int arriving;
+    int holders;
+    bool applied;
+
+    // Tasks to apply and log as one batch, or deferred tasks to run whose
+    // Execute has already been logged at lsn. Neither, for a change which
+    // only waits for every shard to catch up.
+    Task* tasks;
+    int numTasks;
+    TaskChunk* chunk;
+    uint64_t lsn;
+};
+
+/*
+ * Worker which makes every change to the resources in its shard, those
+ * whose name ID modulo the number of shards is its index, including those
+ * of Batch, Execute, the goods file and the replayed log. Handlers gather
+ * their tasks into batches and push them onto stack without a lock, so
+ * each resource's tasks from one neighbour are applied in the order they
+ * arrived, then wake the worker through wakeFd unless it has been
+ * signalled and not yet looked.
+ */
+struct Shard {
+    Depot* depot;
+    pthread_t threadID;
+    ShardBatch* stack;
+    bool signalled;
+    int wakeFd;
 };
 
 /*
@@ -63,55 +790,343 @@ struct Resource {
  */
 struct Depot {
     char* depotName;
+    int nameId;
 
     char* port;
+
+    // The 'Caps' message listing what this depot supports
+    char* capsMessage;
     
-    int numResources;
-    Resource* resources;
+    // Resources indexed by name ID, in chunks matching the name table.
+    // Chunks are created under resourceLock and published atomically.
+    Resource* resourceChunks[TABLE_CHUNKS];
 
-    int numNeighbours;
-    Neighbour* neighbours;
+    // Published atomically; replaced and retired under depotLock
+    NeighbourTable* neighbourTable;
+    NeighbourTable* retiredTables;
 
+    // Open addressing table of pending tasks by key. A slot with no tasks
+    // is empty.
     int numDeferredTasks;
+    int deferredTableSize;
     DeferredTask* deferredTasks;
+
+    DepotConfig config;
+
+    int numEventLoops;
+    int nextEventLoop;
+    EventLoop* eventLoops;
+
+    Connector connector;
+
+    // Workers owning the resources, if DEPOT_SHARDS asks for any. Changes
+    // spanning shards are queued to them under shardLock, so every shard
+    // sees them in the same order, and waited for on shardApplied. So are
+    // the Executes handed to them and not yet run, counted under the lock.
+    int numShards;
+    Shard* shards;
+    pthread_mutex_t shardLock;
+    pthread_cond_t shardApplied;
+    int pendingExecutes;
+
+    // Connections closed since the depot started, updated atomically
+    uint64_t connectionsClosed;
+
+    // Neighbours whose queues are over OUT_QUEUE_LIMIT, updated
+    // atomically. Readers held back meanwhile on their own threads wait
+    // on backlogDrained.
+    int backlogged;
+    pthread_mutex_t backlogLock;
+    pthread_cond_t backlogDrained;
+
+    WriteAheadLog wal;
 };
 
 /*
- * Stores details of a deferred task   
+ * Stores the tasks deferred under a single key, in a list of chunks so
+ * they can all be released at once
  */
 struct DeferredTask {
     unsigned key;
     int numTasks;
-    char** tasks;
+    TaskChunk* firstChunk;
+    TaskChunk* lastChunk;
+};
+
+/*
+ * Block of deferred tasks
+ */
+struct TaskChunk {
+    TaskChunk* next;
+    int numTasks;
+    int capacity;
+    Task tasks[];
 };
 
 /* Functions for initialising, exiting and printing depot */
 void init_depot(int argc, char** argv, Depot* depot);
+void init_config(DepotConfig* config);
 void exit_depot(DepotStatus status);
+void load_goods_file(Depot* depot);
+void* parse_goods_chunk(void* param);
 void print_info(Depot* depot);
 
 /* Functions for starting server and handling connections */
 void start_server(Depot* depot);
+Neighbour* open_neighbour(Depot* depot, int connFd, LineReader* reader);
+void start_neighbour(Neighbour* neighbour);
 void* conn_handler(void* param);
+void close_neighbour(Neighbour* neighbour);
+void release_neighbour(Neighbour* neighbour);
+void free_neighbour(Neighbour* neighbour);
+void handle_message(Neighbour* neighbour, char* message);
+void handle_command(Neighbour* neighbour, Command* command, 
+        long long start);
+void lock_depot(void);
+
+/* Functions for making connections and exchanging IMs */
+void init_connector(Depot* depot);
+void request_connect(Depot* depot, Field port);
+void accept_handshake(Depot* depot, int connFd);
+void* connector_loop(void* param);
+int service_handshakes(Depot* depot);
+bool start_handshake(Depot* depot, Handshake* handshake);
+HandshakeResult advance_handshake(Depot* depot, Handshake* handshake);
+HandshakeResult read_handshake(Depot* depot, Handshake* handshake);
+bool publish_neighbour(Depot* depot, Handshake* handshake, char* imMessage);
+void end_handshake(Depot* depot, Handshake* handshake, bool closeSocket);
+bool has_neighbour_port(Depot* depot, Field port);
+long long now_ms(void);
+
+/* Functions for the event-driven connection mode */
+void init_event_loops(Depot* depot);
+void* event_loop(void* param);
+void adopt_neighbours(EventLoop* loop);
+void free_departed(EventLoop* loop);
+void flush_dirty(EventLoop* loop);
+void schedule_flush(EventLoop* loop);
+void flush_neighbour(EventLoop* loop, Neighbour* neighbour);
+void service_neighbour(EventLoop* loop, Neighbour* neighbour,
+        uint32_t events);
+void watch_neighbour(EventLoop* loop, Neighbour* neighbour, bool writing);
+void hold_neighbour(EventLoop* loop, Neighbour* neighbour);
+void drop_held(EventLoop* loop, Neighbour* neighbour);
+void resume_held(EventLoop* loop);
+
+#ifdef DEPOT_URING
+/* Functions for the io_uring backend */
+Ring* open_ring(bool receiving);
+struct io_uring_sqe* ring_sqe(Ring* ring, void* owner, UringTag tag);
+void submit_ring(Ring* ring, unsigned waitFor);
+void provide_buffer(Ring* ring, unsigned short bufferId);
+void ring_poll(Ring* ring, int fd, UringTag tag);
+void uring_accept(Depot* depot, int serv);
+void* uring_loop(void* param);
+void uring_completed(EventLoop* loop, struct io_uring_cqe* cqe);
+void uring_recv(EventLoop* loop, Neighbour* neighbour);
+void uring_received(EventLoop* loop, Neighbour* neighbour, int result, 
+        unsigned flags);
+void uring_send(EventLoop* loop, Neighbour* neighbour);
+void uring_sent(EventLoop* loop, Neighbour* neighbour, int result);
+void append_line_reader(LineReader* reader, const char* bytes, 
+        size_t length);
+#endif
+
+/* Functions for sending messages to a neighbour */
+void init_out_queue(OutQueue* out, bool coalesce);
+OutMessage* new_out_message(size_t capacity);
+void send_message(Neighbour* neighbour, const char* format, ...);
+void send_task(Neighbour* neighbour, Task* task);
+void switch_to_binary(Neighbour* neighbour);
+void send_caps(Neighbour* neighbour);
+void enqueue_message(Neighbour* neighbour, OutMessage* message);
+void cut_off_neighbour(Neighbour* neighbour, int queued);
+void wake_writer(Neighbour* neighbour);
+void update_backlog(Neighbour* neighbour);
+void release_held_readers(Depot* depot);
+bool backlogged_elsewhere(Neighbour* neighbour);
+bool reader_held(Neighbour* neighbour);
+void wait_for_backlog(Neighbour* neighbour);
+void* writer_thread(void* param);
+bool flush_out_queue(Neighbour* neighbour, int flags);
+void queue_credit_grant(OutQueue* out);
+int gather_out_messages(OutQueue* out, struct iovec* iov, uint64_t synced);
+bool charge_out_message(OutQueue* out, OutMessage** link);
+void take_out_messages(OutQueue* out);
+OutMessage* coalesce_deliveries(OutQueue* out, OutMessage* messages);
+void release_out_messages(OutQueue* out, size_t sent);
+void discard_out_messages(OutQueue* out);
+void dispatch_lines(Neighbour* neighbour);
+void grant_credit(Neighbour* neighbour, long long credit);
+void replenish_credit(Neighbour* neighbour);
+bool credit_overrun(Neighbour* neighbour);
+bool dispatch_message(Neighbour* neighbour);
+
+/* Functions for reading lines from a connection */
+void init_line_reader(LineReader* reader, int fd);
+char* take_line(LineReader* reader);
+ssize_t fill_line_reader(LineReader* reader, int flags);
+uint64_t handled_bytes(LineReader* reader);
+
+/* Functions for the binary protocol */
+OutMessage* encode_out_message(OutQueue* out, OutMessage* message);
+OutMessage* format_task(OutMessage* message);
+OutMessage* encode_task_frame(OutQueue* out, OutMessage* message);
+OutMessage* encode_text_frames(OutMessage* message);
+size_t encode_wire_name(OutQueue* out, char* bytes, int nameId);
+size_t encode_varint(char* bytes, uint64_t value);
+bool take_frame(LineReader* reader, ByteReader* frame);
+bool decode_frame(LineReader* reader, uint8_t type, ByteReader* frame, 
+        Command* command);
+int get_wire_name(LineReader* reader, ByteReader* frame);
+uint64_t get_varint(ByteReader* reader);
+void abandon_reader(LineReader* reader);
+
+/* Functions for the neighbour table */
+NeighbourTable* build_neighbour_table(Neighbour** neighbours,
+        int numNeighbours);
+void publish_neighbours(Depot* depot, NeighbourTable* table);
+void reclaim_tables(Depot* depot);
+NeighbourTable* read_neighbours(Depot* depot);
+Neighbour* next_named(NeighbourTable* table, int nameId, int* probe);
+Neighbour* find_neighbour_port(NeighbourTable* table, Field port);
+RcuReader* rcu_reader(void);
+void release_rcu_reader(void);
+void rcu_read_lock(void);
+void rcu_read_unlock(void);
+
+/* Functions for routing transfers between depots */
+void compute_routes(Depot* depot, NeighbourTable* table);
+void advertise_routes(Depot* depot, NeighbourTable* table);
+char* format_routes(Depot* depot, NeighbourTable* table, Neighbour* to);
+bool deliver_to(NeighbourTable* table, Task* transfer);
+bool forward_delivery(NeighbourTable* table, Task* transfer, int hops);
+void handle_route_message(Depot* depot, Command* routeCommand);
+void handle_forward_message(Depot* depot, Command* forwardCommand);
+bool valid_routes(Field list);
 
 /* Functions for handling messages */
-void add_neighbour(Depot* depot, Neighbour* neighbour, char* imMessage);
-void add_resource(Depot* depot, char* deliverMessage);
-void withdraw_resource(Depot* depot, char* withdrawMessage);
-void handle_defer_message(Depot* depot, char* deferMessage);
-void handle_execute(Depot* depot, char* executeMessage);
-void handle_connect_message(Depot* depot, char* connectMessage);
-void handle_transfer_message(Depot* depot, char* transferMessage);
+void add_neighbour(Depot* depot, Neighbour* neighbour, Command* imCommand);
+void remove_neighbour(Depot* depot, Neighbour* neighbour);
+void add_resource(Depot* depot, Command* deliverCommand);
+void withdraw_resource(Depot* depot, Command* withdrawCommand);
+void handle_defer_message(Depot* depot, Command* deferCommand);
+void handle_execute(Depot* depot, Command* executeCommand);
+void apply_deferred(Depot* depot, TaskChunk* chunk);
+void grow_deferred_deltas(int nameId);
+void handle_connect_message(Depot* depot, Command* connectCommand);
+void handle_transfer_message(Depot* depot, Command* transferCommand);
+void handle_batch_message(Depot* depot, Command* batchCommand);
+void handle_caps_message(Depot* depot, Command* capsCommand);
+void handle_binary_message(Depot* depot, Command* binaryCommand);
+void handle_credit_message(Depot* depot, Command* creditCommand);
+char* format_capabilities(unsigned caps, int creditWindow);
+
+/* Functions for running deliveries, withdrawals and transfers */
+bool make_task(Command* command, Task* task);
+Task* make_tasks(Command* command, int* numTasks);
+void run_task(Depot* depot, Task* task);
+void send_transfer(Depot* depot, Task* task);
+void apply_task(Depot* depot, Task* task);
+
+/* Functions for the resource shards */
+void init_shards(Depot* depot);
+bool shard_task(Depot* depot, Task* task);
+void push_shard_batch(Shard* shard, ShardBatch* batch);
+void flush_shard_batches(Depot* depot);
+void hold_back_feeder(Depot* depot);
+void release_shard_batches(void);
+bool shard_tasks(Depot* depot, Task* tasks, int numTasks);
+bool shard_deferred(Depot* depot, TaskChunk* chunk);
+void wait_for_executes(Depot* depot);
+void drain_shards(Depot* depot);
+void submit_shard_change(Depot* depot, ShardChange* change, bool wait);
+void reach_shard_change(Depot* depot, ShardChange* change);
+void release_shard_change(ShardChange* change);
+void* shard_worker(void* param);
+void run_shard_batches(Shard* shard, ShardBatch* batches);
+
+/* Functions for persisting the depot's state */
+bool recover_state(Depot* depot);
+void start_persistence(Depot* depot);
+void begin_change(Depot* depot);
+void end_change(Depot* depot);
+void log_task(Depot* depot, Task* task);
+void log_defer(Depot* depot, unsigned key, Task* tasks, int numTasks);
+void log_batch(Depot* depot, Task* tasks, int numTasks);
+void log_execute(Depot* depot, unsigned key);
+size_t begin_record(WriteAheadLog* wal, RecordType type);
+void end_record(WriteAheadLog* wal, size_t start);
+void* wal_thread(void* param);
+void wait_for_sync(WriteAheadLog* wal, uint64_t lsn);
+void wake_synced(Depot* depot, uint64_t synced);
+uint64_t synced_lsn(Depot* depot);
+int open_wal(Depot* depot, unsigned generation);
+void rotate_wal(Depot* depot, int fd);
+void* snapshot_thread(void* param);
+void take_snapshot(Depot* depot);
+void encode_snapshot(Depot* depot, ByteBuffer* buffer);
+bool load_snapshot(Depot* depot, unsigned* generation);
+void replay_wal(Depot* depot, unsigned generation);
+bool replay_record(Depot* depot, ByteReader* reader);
+void replay_task(Depot* depot, Task* task);
+int list_wals(Depot* depot, unsigned** generations);
+void remove_wals(Depot* depot, unsigned before);
+char* data_path(Depot* depot, const char* name, unsigned generation);
+void sync_data_dir(Depot* depot);
+
+/* Functions for encoding and decoding persisted state */
+void put_bytes(ByteBuffer* buffer, const void* bytes, size_t length);
+void put_u8(ByteBuffer* buffer, uint8_t value);
+void put_u32(ByteBuffer* buffer, uint32_t value);
+void put_u64(ByteBuffer* buffer, uint64_t value);
+void put_name(ByteBuffer* buffer, const char* name);
+void put_task(ByteBuffer* buffer, Task* task);
+void get_bytes(ByteReader* reader, void* bytes, size_t length);
+uint8_t get_u8(ByteReader* reader);
+uint32_t get_u32(ByteReader* reader);
+uint64_t get_u64(ByteReader* reader);
+int get_name(ByteReader* reader);
+bool get_task(ByteReader* reader, Task* task);
+uint32_t checksum(const char* bytes, size_t length);
+bool write_all(int fd, const char* bytes, size_t length);
+
+/* Functions for the resource table */
+void init_resources(Depot* depot);
+Resource* get_resource(Depot* depot, int nameId);
+Resource* find_resource(Depot* depot, int nameId);
+
+/* Functions for the name table */
+void init_names(void);
+int intern_name(Field name);
+int find_name(Field name, unsigned long hash);
+const char* name_text(int nameId);
+Name* name_at(int nameId);
+int insert_name(Field name, unsigned long hash);
+void reserve_names(int count);
+void index_name(NameIndex* index, Name* name, int nameId);
+void grow_name_index(void);
+unsigned long hash_name(Field name);
+int locate_chunk(int position, int* offset);
+
+/* Functions for the deferred task table */
+void init_deferred(Depot* depot);
+DeferredTask* find_deferred(Depot* depot, unsigned key);
+DeferredTask* get_deferred(Depot* depot, unsigned key);
+TaskChunk* take_deferred(Depot* depot, unsigned key);
+void grow_deferred(Depot* depot);
+void remove_deferred(Depot* depot, DeferredTask* deferred);
+void append_task(DeferredTask* deferred, Task* task);
+unsigned hash_key(unsigned key);
 
 /* Functions for parsing information from messages */
-bool parse_deliver_withdraw_message(char* message, int* quantity, 
-        char** name); 
-bool parse_im_message(char* imMessage, char** port, char** name);
-bool parse_defer_message(char* deferMessage, unsigned* key, char** task);
-bool parse_execute_message(char* executeMessage, unsigned* key);
-bool parse_connect_message(char* connectMessage, char** port);
-bool parse_transfer_message(char* transferMessage, int* quantity, char** name,
-        char** dest);
+bool parse_message(const char* message, Command* command);
+bool parse_fields(Command* command, Field* fields, int numFields);
+bool parse_number(Field field, unsigned long* number);
+bool next_field(Field* list, Field* field);
+bool next_batch_op(Field* list, long* quantity, Field* name);
+bool valid_batch(Field list);
+bool field_equals(Field field, const char* string);
 
 /* Signal handling functions */
 void init_sig(Depot* depot);
@@ -119,10 +1134,25 @@ void* handle_signals(void* arg);
 
 /* Comparator functions for sorting */
 int comp_resources(const void* v1, const void* v2);
-int comp_neighbours(const void* v1, const void* v2);
+int comp_names(const void* v1, const void* v2);
+int comp_generations(const void* v1, const void* v2);
+
+/* Functions for runtime metrics */
+ThreadMetrics* thread_metrics(void);
+void release_thread_metrics(void);
+void count(uint64_t* counter, uint64_t amount);
+void record_time(Histogram* histogram, uint64_t nanoseconds);
+int histogram_bucket(uint64_t value);
+uint64_t bucket_limit(int bucket);
+uint64_t histogram_percentile(Histogram* histogram, uint64_t total,
+        double percentile);
+void dump_metrics(Depot* depot);
+void dump_histogram(Histogram* histogram);
+void dump_string(const char* string);
+long long now_ns(void);
 
 /* Helper functions */
-char* read_line(FILE* file, size_t size);
+int env_int(const char* name, int defaultValue);
 bool contains_bad_char(char* argument);
-MessageType determine_message_type(char* message);
+MessageType determine_message_type(const char* message);
 